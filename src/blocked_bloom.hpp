@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Split-block Bloom filter (the layout Parquet uses): each key maps to one 32-byte
+// block and sets one bit in each of its eight 32-bit words, so a lookup touches a
+// single cache line. At 10 bits per key the false-positive rate is about 1%.
+class BlockedBloomFilter
+{
+public:
+    static constexpr size_t block_words = 8;
+
+    BlockedBloomFilter() = default;
+
+    explicit BlockedBloomFilter(size_t n_blocks) : words(std::max<size_t>(n_blocks, 1) * block_words, 0) {}
+
+    // Sets the key's bits and returns whether they were all set already, i.e. whether
+    // the key was (probably) inserted before.
+    bool test_and_set(uint64_t key)
+    {
+        const uint64_t h = remix(key);
+        uint32_t *block = &words[block_of(h) * block_words];
+        const uint32_t low = static_cast<uint32_t>(h);
+        bool seen = true;
+        for (size_t w = 0; w < block_words; w++)
+        {
+            const uint32_t bit = uint32_t(1) << ((low * salts[w]) >> 27);
+            seen &= (block[w] & bit) != 0;
+            block[w] |= bit;
+        }
+        return seen;
+    }
+
+    void prefetch(uint64_t key) const
+    {
+        __builtin_prefetch(&words[block_of(remix(key)) * block_words]);
+    }
+
+    size_t bytes() const
+    {
+        return words.size() * sizeof(uint32_t);
+    }
+
+    // Chance that a key never inserted tests as seen, from the current fill: a block
+    // answers yes when the key's bit is set in all eight words.
+    double false_positive_rate() const
+    {
+        double sum = 0;
+        for (size_t b = 0; b < words.size(); b += block_words)
+        {
+            double p = 1;
+            for (size_t w = 0; w < block_words; w++)
+            {
+                p *= __builtin_popcount(words[b + w]) / 32.0;
+            }
+            sum += p;
+        }
+        return words.empty() ? 0 : sum * block_words / static_cast<double>(words.size());
+    }
+
+private:
+    static constexpr uint32_t salts[block_words] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                                                    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+    std::vector<uint32_t> words;
+
+    // FracMinHash values have zero top bits and phmap reads bits 8-31 to pick the
+    // submap, so remix (MurmurHash3's finaliser) before choosing a block.
+    static uint64_t remix(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    size_t block_of(uint64_t h) const
+    {
+        return static_cast<size_t>(((h >> 32) * (words.size() / block_words)) >> 32);
+    }
+};
+
+// Outcome of screening singletons with a Bloom filter in front of a count map.
+struct BloomStats
+{
+    uint64_t filter_bytes = 0;
+    // Hashes whose first sighting only set filter bits.
+    uint64_t first_sightings = 0;
+    // Hashes that entered the map: seen again, or a false positive on first sight.
+    uint64_t promoted = 0;
+    // Singletons kept out of the map: first sightings never promoted. A lower bound,
+    // since a false positive on first sight enters the map without a first sighting.
+    uint64_t screened = 0;
+    double false_positive_rate = 0;
+    // Map slots (key, count and control byte) those singletons would have taken.
+    uint64_t slot_bytes_avoided = 0;
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Count-min sketch in a fixed memory budget, blocked so that each key touches one
+// cache line: the key picks a 64-byte block of thirty-two 16-bit counters and four
+// of its lanes. Updates are conservative (only the lanes at the current minimum are
+// raised), which keeps overestimates well below those of the plain update. Counters
+// saturate at max_count; twice the lanes of 32-bit counters measured several times
+// fewer overestimates for the same budget, and abundances past 65535 only need to
+// read as "very high".
+//
+// The lane loops run over a whole block under a mask, without gathers, so the
+// compiler turns them into a few vector min/max instructions.
+//
+// Blocks are grouped into 2^part_bits equal partitions chosen by the top hash bits,
+// so workers owning distinct partitions never share a block.
+class BlockedCountMinSketch
+{
+public:
+    static constexpr size_t lanes = 32;
+    static constexpr uint32_t max_count = std::numeric_limits<uint16_t>::max();
+    static constexpr int probes = 4;
+    static constexpr int part_bits = 10;
+
+    explicit BlockedCountMinSketch(size_t memory_bytes)
+        : blocks_per_part(std::max<size_t>(1, memory_bytes / sizeof(Block) / n_parts())),
+          blocks(blocks_per_part * n_parts())
+    {
+    }
+
+    static constexpr size_t n_parts()
+    {
+        return size_t(1) << part_bits;
+    }
+
+    // Spreads FracMinHash values (whose top bits are zero) over all 64 bits with
+    // MurmurHash3's finaliser; every other method takes the remixed value.
+    static uint64_t remix(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    static size_t part(uint64_t h)
+    {
+        return static_cast<size_t>(h >> (64 - part_bits));
+    }
+
+    // Counts one more occurrence and returns the key's new estimate.
+    uint32_t add(uint64_t h)
+    {
+        uint16_t *counters = block(h).counters;
+        const uint32_t mask = lane_mask(h);
+        const uint32_t current = min_over(counters, mask);
+        const uint16_t next = static_cast<uint16_t>(current + (current < max_count));
+        for (size_t l = 0; l < lanes; l++)
+        {
+            const uint16_t raised = std::max(counters[l], next);
+            counters[l] = (mask >> l) & 1 ? raised : counters[l];
+        }
+        return next;
+    }
+
+    uint32_t estimate(uint64_t h) const
+    {
+        return min_over(block(h).counters, lane_mask(h));
+    }
+
+    void prefetch(uint64_t h) const
+    {
+        __builtin_prefetch(&block(h));
+    }
+
+    size_t bytes() const
+    {
+        return blocks.size() * sizeof(Block);
+    }
+
+private:
+    struct Block
+    {
+        alignas(64) uint16_t counters[lanes];
+    };
+
+    size_t blocks_per_part;
+    std::vector<Block> blocks;
+
+    // Bits 0-31 pick the block inside the partition and bits 32-51 the lanes.
+    const Block &block(uint64_t h) const
+    {
+        const size_t offset = static_cast<size_t>(((h & 0xffffffffULL) * blocks_per_part) >> 32);
+        return blocks[part(h) * blocks_per_part + offset];
+    }
+
+    Block &block(uint64_t h)
+    {
+        return const_cast<Block &>(static_cast<const BlockedCountMinSketch &>(*this).block(h));
+    }
+
+    static uint32_t lane_mask(uint64_t h)
+    {
+        uint32_t mask = 0;
+        for (int p = 0; p < probes; p++)
+        {
+            mask |= uint32_t(1) << ((h >> (32 + 5 * p)) & (lanes - 1));
+        }
+        return mask;
+    }
+
+    static uint32_t min_over(const uint16_t *counters, uint32_t mask)
+    {
+        uint16_t smallest = max_count;
+        for (size_t l = 0; l < lanes; l++)
+        {
+            smallest = std::min(smallest, (mask >> l) & 1 ? counters[l] : uint16_t(max_count));
+        }
+        return smallest;
+    }
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+
+#include <parallel_hashmap/phmap.h>
+
+// phmap normally runs every hasher output through phmap_mix. The counters pick their
+// own mixing through the hasher below instead, so the build must switch that off.
+#if !PHMAP_DISABLE_MIX
+#error "Build with PHMAP_DISABLE_MIX=1 so the counter hashers are used as-is."
+#endif
+
+// std::hash followed by phmap's mixer: what the maps did before the hasher became a
+// parameter. Safe for arbitrary keys.
+struct MixedHash
+{
+    size_t operator()(uint64_t key) const
+    {
+        return phmap::phmap_mix<sizeof(size_t)>()(std::hash<uint64_t>()(key));
+    }
+};
+
+// Keys are FracMinHash values: MurmurHash64 outputs kept when below max_hash, so only
+// the top bits are biased (towards zero) and the low bits phmap uses for the probe
+// start, control byte and submap index are already uniform. Use them as they are.
+struct FracMinHash
+{
+    size_t operator()(uint64_t key) const
+    {
+        return static_cast<size_t>(key);
+    }
+};
+
+// The counters' map type: 2^6 submaps, each guarded by its own Mutex. Allocator is
+// std::allocator or HugePageAllocator (see huge_page_allocator.hpp). Mutex is one of
+//   std::mutex         the default: calls may overlap, each locking a submap while it
+//                      touches it (walks such as get_kmers() go one submap at a time,
+//                      so they see each submap whole but not the map as one snapshot),
+//   phmap::NullMutex   no locking, for callers that never overlap calls (each submap
+//                      is still updated by one worker at a time within a call),
+//   std::shared_mutex  lookups take read locks, so they run alongside each other and
+//                      alongside ingest into other submaps.
+template <typename Value, typename Hash, template <typename> class Allocator = std::allocator,
+          typename Mutex = std::mutex>
+using CounterMap = phmap::parallel_flat_hash_map<uint64_t, Value, Hash, std::equal_to<uint64_t>,
+                                                 Allocator<std::pair<uint64_t, Value>>, 6, Mutex>;
@@ -1,12 +1,12 @@
 import click
 import logging
-import os
+import resource
 import sys
 from typing import List
 import numpy as np
 from tqdm import tqdm
-from ._hashes_counter_impl import HashesCounter, WeightedHashesCounter, WeightedHashesCounterUncapped, SamplesKmerDosageHybridCounter
-from snipe import SnipeSig, SigType
+from ._hashes_counter_impl import estimate_cardinality, signature_info, write_signature, HashesCounter, SortedHashesCounter, CompactHashesCounter, ApproxHashesCounter, SpillingHashesCounter, HugePageHashesCounter, UnlockedHashesCounter, HashesCounter8, HashesCounter16, WeightedHashesCounter, WeightedHashesCounterUncapped, UnlockedWeightedHashesCounter, SamplesKmerDosageHybridCounter, UnlockedSamplesKmerDosageHybridCounter, PackedSamplesKmerDosageHybridCounter, FixedWeightedHashesCounter, FixedWeightedHashesCounter64, FixedSamplesKmerDosageHybridCounter64
+from snipe import SnipeSig
 
 logger = logging.getLogger(__name__)
 
@@ -26,6 +26,55 @@ root_logger = logging.getLogger()
 root_logger.setLevel(logging.DEBUG)  
 for handler in root_logger.handlers:
     handler.setFormatter(formatter)
+def log_ingest_stats(stats):
+    """Logs per-stage throughput of a pipelined signature ingest."""
+    decode_rate = stats.hashes / stats.decode_seconds * stats.loaders if stats.decode_seconds > 0 else float('inf')
+    insert_rate = stats.hashes / stats.insert_seconds if stats.insert_seconds > 0 else float('inf')
+    logger.info(
+        f"Ingested {stats.signatures} signatures ({stats.hashes} hashes) in {stats.wall_seconds:.2f}s."
+    )
+    logger.debug(
+        f"Load stage: {stats.loaders} loaders, {decode_rate:,.0f} hashes/s, "
+        f"{stats.loader_blocked_seconds:.2f}s blocked on a full queue."
+    )
+    logger.debug(
+        f"Insert stage: {insert_rate:,.0f} hashes/s, {stats.consumer_idle_seconds:.2f}s waiting for signatures."
+    )
+    if stats.consumer_idle_seconds > stats.loader_blocked_seconds / stats.loaders:
+        logger.debug("Ingest was load-bound (I/O or decoding); consider more --loaders.")
+    else:
+        logger.debug("Ingest was insert-bound; consider more --threads.")
+
+
+def write_output_signature(path, hashes, abundances, ksize, scale, name, threads):
+    """Writes one signature: .sig and .sig.gz are streamed natively, .zip goes through SnipeSig."""
+    if path.lower().endswith('.zip'):
+        SnipeSig.create_from_hashes_abundances(
+            hashes=hashes,
+            abundances=abundances,
+            ksize=ksize,
+            scale=scale,
+            name=name,
+        ).export(path)
+        return
+    write_signature(
+        path,
+        np.asarray(hashes, dtype=np.uint64),
+        np.asarray(abundances, dtype=np.uint32),
+        ksize=ksize,
+        scale=scale,
+        name=name,
+        threads=threads,
+    )
+
+
+def peak_rss_mb():
+    """Peak resident set size of this process so far, in MiB."""
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # ru_maxrss is reported in bytes on macOS and in KiB elsewhere.
+    return peak / (1024 * 1024) if sys.platform == 'darwin' else peak / 1024
+
+
 @click.command()
 @click.argument(
     'signature_paths',
@@ -44,7 +93,7 @@ for handler in root_logger.handlers:
     '-o',
     required=True,
     type=click.Path(writable=True),
-    help='Output file path. Must end with .sig or .zip.',
+    help='Output file path. Must end with .sig, .sig.gz or .zip.',
 )
 @click.option(
     '--name',
@@ -78,6 +127,118 @@ for handler in root_logger.handlers:
     default=False,
     help='Use hybrid hashes counter (sample freq + kmer dosage).',
 )
+@click.option(
+    '--fixed-point',
+    type=click.IntRange(0, 63),
+    default=0,
+    show_default=True,
+    help='Accumulate --weighted or --hybrid scores in fixed point with this many fractional bits '
+         '(0 keeps floats). Sums are then exact, so results do not depend on thread count or input order. '
+         'For --weighted, up to 16 bits use 32-bit accumulators and more use 64-bit ones; '
+         '--hybrid always uses 64-bit ones, as its dosages sum over every sample.',
+)
+@click.option(
+    '--backend',
+    type=click.Choice(['hash', 'sort', 'compact', 'approx', 'spill']),
+    default='hash',
+    show_default=True,
+    help='Counting engine for plain counting: a hash table, sorted runs merged as they accumulate, '
+         'a compact table storing only the bits a scaled hash can use (about half the memory), '
+         'a count-min sketch of fixed size giving approximate abundances (never underestimated), '
+         'or a hash table of bounded size that spills to temporary files when full. '
+         'With --hybrid, compact selects a packed 12-byte-per-hash table.',
+)
+@click.option(
+    '--approx-memory',
+    type=float,
+    default=4,
+    show_default=True,
+    help='Sketch size in GiB for --backend approx. Hashes estimated at the --min-abund threshold '
+         '(at least 2) are kept on top of it.',
+)
+@click.option(
+    '--spill-memory',
+    type=float,
+    default=8,
+    show_default=True,
+    help='In-memory table size in GiB for --backend spill; filtering and export add about one '
+         'spill partition per thread on top.',
+)
+@click.option(
+    '--temp-dir',
+    type=click.Path(file_okay=False),
+    default=None,
+    help='Directory for the spill files of --backend spill (defaults to TMPDIR or /tmp).',
+)
+@click.option(
+    '--count-bits',
+    type=click.Choice(['32', '16', '8']),
+    default='32',
+    show_default=True,
+    help='Width of the counts kept by the hash backend. Narrow counts cut table memory roughly in half; '
+         'hashes that outgrow them move to a small overflow map, so results are unchanged.',
+)
+@click.option(
+    '--huge-pages',
+    is_flag=True,
+    default=False,
+    help='Back the hash backend\'s table with 2 MB (or 1 GB) pages, cutting TLB misses on large tables. '
+         'Uses reserved hugetlbfs pages when available, otherwise transparent huge pages.',
+)
+@click.option(
+    '--no-locks',
+    is_flag=True,
+    default=False,
+    help='Use counters built without submap locks. Safe here because counting threads never share a submap; '
+         'saves the lock acquisitions on every batch.',
+)
+@click.option(
+    '--singleton-screen',
+    type=float,
+    default=0,
+    show_default=True,
+    help='Bits per distinct hash for a Bloom filter that keeps first sightings out of the count map, '
+         'so singletons never take a slot (0 disables). A false positive adds one to a count.',
+)
+@click.option(
+    '--threads',
+    '-t',
+    type=int,
+    default=1,
+    show_default=True,
+    help='Number of threads used for counting (0 uses all available cores).',
+)
+@click.option(
+    '--loaders',
+    type=int,
+    default=0,
+    show_default=True,
+    help='Number of threads decoding signatures while counting proceeds (0 uses half of --threads, at least 1). '
+         'They run alongside the --threads counting workers.',
+)
+@click.option(
+    '--queue-size',
+    type=int,
+    default=0,
+    show_default=True,
+    help='Maximum number of decoded signatures waiting to be counted (0 uses twice the loaders).',
+)
+@click.option(
+    '--presize',
+    type=click.Choice(['none', 'hll', 'sum']),
+    default='none',
+    show_default=True,
+    help='Size the counter once before counting: from a HyperLogLog estimate of the distinct hashes '
+         '(an extra decoding pass), or from the sum of signature sizes (an upper bound, read from zip manifests when available). '
+         '--hybrid --backend compact uses hll unless sum is given.',
+)
+@click.option(
+    '--ksize',
+    '-k',
+    type=int,
+    default=None,
+    help='k-mer size to select from signatures holding several sketches.',
+)
 def hashes_counter(
     signature_paths: List[str],
     samples_from_file: str,
@@ -87,6 +248,20 @@ def hashes_counter(
     weighted: bool,
     uncapped: bool,
     hybrid: bool,
+    fixed_point: int,
+    backend: str,
+    approx_memory: float,
+    spill_memory: float,
+    temp_dir: str,
+    count_bits: str,
+    huge_pages: bool,
+    no_locks: bool,
+    singleton_screen: float,
+    threads: int,
+    loaders: int,
+    queue_size: int,
+    presize: str,
+    ksize: int,
 ):
     """
     Snipe plugin for high-throughput counting of k-mers.
@@ -97,6 +272,36 @@ def hashes_counter(
     if hybrid and weighted:
         logger.error("Options --weighted and --hybrid are mutually exclusive.")
         sys.exit(1)
+
+    if backend != 'hash' and (weighted or hybrid) and not (backend == 'compact' and hybrid):
+        logger.error(f"Option --backend {backend} only supports plain counting.")
+        sys.exit(1)
+
+    if fixed_point > 0 and not (weighted or hybrid):
+        logger.error("Option --fixed-point only applies to --weighted or --hybrid.")
+        sys.exit(1)
+
+    if fixed_point > 0 and backend == 'compact':
+        logger.error("Option --fixed-point is not supported by the packed hybrid counter of --backend compact.")
+        sys.exit(1)
+
+    if count_bits != '32' and (backend != 'hash' or weighted or hybrid):
+        logger.error("Option --count-bits only applies to plain counting with --backend hash.")
+        sys.exit(1)
+
+    if huge_pages and (backend != 'hash' or count_bits != '32' or weighted or hybrid):
+        logger.error("Option --huge-pages only applies to plain counting with the default counter.")
+        sys.exit(1)
+
+    if no_locks and (backend != 'hash' or count_bits != '32' or huge_pages or fixed_point > 0):
+        logger.error("Option --no-locks only applies to the default counters (no --backend, --count-bits, --huge-pages or --fixed-point).")
+        sys.exit(1)
+
+    if singleton_screen > 0 and (backend != 'hash' or count_bits != '32' or weighted or hybrid):
+        # Weighted scores can pass the >1 rule from a single sample, so a sighting
+        # count says nothing about which hashes round_scores() will drop.
+        logger.error("Option --singleton-screen only applies to plain counting with the default counter.")
+        sys.exit(1)
     
     
     try:
@@ -113,105 +318,187 @@ def hashes_counter(
             logger.error("No signature paths provided.")
             sys.exit(1)
         
-        valid_extensions = {'.sig', '.zip'}
-        output_ext = os.path.splitext(output)[1].lower()
-        if output_ext not in valid_extensions:
-            logger.error(f"Invalid output file extension '{output_ext}'. Must be one of {valid_extensions}.")
+        valid_extensions = ('.sig', '.sig.gz', '.zip')
+        if not output.lower().endswith(valid_extensions):
+            logger.error(f"Invalid output file extension for '{output}'. Must be one of {valid_extensions}.")
             sys.exit(1)
         logger.info(f"Counting hashes from {len(all_signature_paths)} signatures.")
         
-        if weighted:
+        if weighted and fixed_point > 0:
+            counter_class = FixedWeightedHashesCounter if fixed_point <= 16 else FixedWeightedHashesCounter64
+            logger.info(f"Using {counter_class.__name__} with {fixed_point} fractional bits{' (uncapped)' if uncapped else ''}.")
+            counter = counter_class(threads=threads, capped=not uncapped, fraction_bits=fixed_point)
+        elif weighted and no_locks:
+            logger.info(f"Using{' uncapped' if uncapped else ''} UnlockedWeightedHashesCounter.")
+            counter = UnlockedWeightedHashesCounter(threads=threads, capped=not uncapped)
+        elif weighted:
             if uncapped:
                 logger.info("Using uncapped WeightedHashesCounter.")
-                counter = WeightedHashesCounterUncapped()
+                counter = WeightedHashesCounterUncapped(threads=threads)
             else:
                 logger.info("Using WeightedHashesCounter.")
-                counter = WeightedHashesCounter()
+                counter = WeightedHashesCounter(threads=threads)
+        elif hybrid and fixed_point > 0:
+            # A dosage sums over every sample, so large cohorts need the 64-bit accumulator's integer headroom.
+            logger.info(f"Using FixedSamplesKmerDosageHybridCounter64 with {fixed_point} fractional bits.")
+            counter = FixedSamplesKmerDosageHybridCounter64(threads=threads, fraction_bits=fixed_point)
+        elif hybrid and backend == 'compact':
+            info = signature_info(all_signature_paths[0], ksize=ksize or 0)
+            logger.info(f"Using PackedSamplesKmerDosageHybridCounter for scale {info.scale}.")
+            counter = PackedSamplesKmerDosageHybridCounter(scale=info.scale, threads=threads)
+        elif hybrid and no_locks:
+            logger.info("Using UnlockedSamplesKmerDosageHybridCounter.")
+            counter = UnlockedSamplesKmerDosageHybridCounter(threads=threads)
         elif hybrid:
             logger.info("Using SamplesKmerDosageHybridCounter.")
-            counter = SamplesKmerDosageHybridCounter()
+            counter = SamplesKmerDosageHybridCounter(threads=threads)
+        elif backend == 'compact':
+            # The key layout depends on the scale, so read it from the first signature.
+            info = signature_info(all_signature_paths[0], ksize=ksize or 0)
+            logger.info(f"Using CompactHashesCounter for scale {info.scale}.")
+            counter = CompactHashesCounter(scale=info.scale, threads=threads)
+        elif backend == 'approx':
+            logger.info(f"Using ApproxHashesCounter with a {approx_memory:g} GiB sketch.")
+            counter = ApproxHashesCounter(
+                memory_bytes=int(approx_memory * 2**30), threads=threads, heavy_threshold=max(2, min_abund or 0)
+            )
+        elif backend == 'spill':
+            logger.info(f"Using SpillingHashesCounter with a {spill_memory:g} GiB table.")
+            counter = SpillingHashesCounter(
+                memory_bytes=int(spill_memory * 2**30), threads=threads, temp_dir=temp_dir or ''
+            )
+        elif backend == 'sort':
+            logger.info("Using SortedHashesCounter.")
+            counter = SortedHashesCounter(threads=threads)
+        elif count_bits == '16':
+            logger.info("Using HashesCounter16.")
+            counter = HashesCounter16(threads=threads)
+        elif count_bits == '8':
+            logger.info("Using HashesCounter8.")
+            counter = HashesCounter8(threads=threads)
+        elif huge_pages:
+            logger.info("Using HugePageHashesCounter.")
+            counter = HugePageHashesCounter(threads=threads)
+        elif no_locks:
+            logger.info("Using UnlockedHashesCounter.")
+            counter = UnlockedHashesCounter(threads=threads)
         else:
             logger.info("Using HashesCounter.")
-            counter = HashesCounter()
+            counter = HashesCounter(threads=threads)
         
-        first_sig_path = all_signature_paths[0]
-        logger.debug(f"Processing first signature: {first_sig_path}")
-        first_sig = SnipeSig(sourmash_sig=first_sig_path, sig_type=SigType.SAMPLE)
-        auto_detected_scale = first_sig.scale
-        auto_detected_ksize = first_sig.ksize
-        if weighted or hybrid:
-            counter.add_hashes(first_sig.hashes, first_sig.abundances, first_sig.mean_abundance)
-        else:
-            counter.add_hashes(first_sig.hashes)
+        if hybrid and backend == 'compact' and presize == 'none':
+            # The packed tables grow by half and rehash often; sizing them once keeps the insert rate.
+            logger.info("Presizing the packed hybrid counter from a HyperLogLog estimate.")
+            presize = 'hll'
+
+        if backend in ('approx', 'spill') and presize != 'none':
+            logger.warning(f"Backend {backend} has a fixed memory size; ignoring --presize.")
+        elif presize != 'none' or singleton_screen > 0:
+            estimate = estimate_cardinality(
+                all_signature_paths, ksize=ksize or 0, method='hll' if presize == 'none' else presize,
+                loaders=loaders or threads,
+            )
+            logger.info(
+                f"Estimated {estimate.distinct} distinct hashes (upper bound {estimate.upper_bound}) "
+                f"in {estimate.seconds:.2f}s."
+            )
+            if singleton_screen > 0:
+                # The map will only hold repeated hashes, so the estimate sizes the filter instead.
+                counter.screen_singletons(estimate.distinct, bits_per_hash=singleton_screen)
+            else:
+                # Leave room for the HyperLogLog error (about 1%) so the estimate does not
+                # fall just short and trigger one last rehash.
+                counter.reserve(int(estimate.distinct * 1.03) if presize == 'hll' else estimate.distinct)
+
+        # Signatures (.sig, .sig.gz and members of .zip collections) are decoded natively by
+        # loader threads while the counter drains them, so loading and counting overlap.
+        with tqdm(desc="Processing signatures", unit="sig") as progress_bar:
+            def report_progress(done, total):
+                progress_bar.total = total
+                progress_bar.update(done - progress_bar.n)
+
+            stats = counter.add_signature_files(
+                all_signature_paths,
+                ksize=ksize or 0,
+                loaders=loaders,
+                queue_size=queue_size,
+                progress=report_progress,
+            )
+        log_ingest_stats(stats)
+        if backend == 'spill':
+            logger.info(f"Spilled the table {counter.spill_count()} times ({counter.spilled_bytes() / 2**20:.0f} MiB on disk).")
+        logger.debug(f"Peak RSS after counting: {peak_rss_mb():.0f} MiB.")
+        auto_detected_scale = counter.scale()
+        auto_detected_ksize = counter.ksize()
         
         logger.debug(f"Detected scale: {auto_detected_scale}, Detected ksize: {auto_detected_ksize}")
         
-        for sig_path in tqdm(all_signature_paths[1:], desc="Processing signatures"):
-            snipe_sig = SnipeSig(sourmash_sig=sig_path, sig_type=SigType.SAMPLE)
-            if snipe_sig.scale != auto_detected_scale or snipe_sig.ksize != auto_detected_ksize:
-                logger.error(f"Signature '{sig_path}' has inconsistent scale or ksize.")
-                sys.exit(1)
-            if weighted or hybrid:
-                counter.add_hashes(snipe_sig.hashes, snipe_sig.abundances, snipe_sig.mean_abundance)
-            else:
-                counter.add_hashes(snipe_sig.hashes)
-        if weighted or hybrid:
+        # The exact counters filter while exporting straight to sorted NumPy arrays
+        # (the spill counter in one read of its files).
+        exports = backend in ('hash', 'compact', 'spill', 'sort') and not hybrid
+        
+        if backend == 'approx':
+            # The sketch only lists the hashes that reached the threshold it was built with.
+            hash_to_abundance = counter.heavy_hitters()
+            logger.info(
+                f"Kept {len(hash_to_abundance)} hashes estimated at >= {max(2, min_abund or 0)} "
+                f"out of {counter.total()} counted."
+            )
+        elif weighted or hybrid:
             logger.info("Rounding scores in WeightedHashesCounter.")
             skipped_hashes = counter.round_scores()
             logger.info(f"Skipped {skipped_hashes} hashes with <2 after rounding.")
         else:
-            logger.info("Removing singleton k-mers.")
-            count_removed = counter.remove_singletons()
-            logger.info(f"Removed {count_removed} singleton k-mers, current size: {counter.size()}.")
+            if singleton_screen > 0:
+                bloom = counter.bloom_stats()
+                logger.info(
+                    f"Singleton screen: {bloom.screened} hashes kept out of the map, "
+                    f"{bloom.filter_bytes / 2**20:.0f} MiB filter vs {bloom.slot_bytes_avoided / 2**20:.0f} MiB of slots avoided, "
+                    f"false-positive rate {bloom.false_positive_rate:.2%}."
+                )
+            if not exports:
+                logger.info("Removing singleton k-mers.")
+                count_removed = counter.remove_singletons()
+                logger.info(f"Removed {count_removed} singleton k-mers, current size: {counter.size()}.")
         
-        if min_abund is not None:
+        if min_abund is not None and backend != 'approx' and not exports:
             logger.info(f"Applying minimum abundance filter: {min_abund}.")
-            counter.keep_min_abundance(min_abund)
-            logger.info(f"Kept only k-mers with abundance >= {min_abund}, current size: {counter.size()}.")
+            count_removed = counter.keep_min_abundance(min_abund)
+            logger.info(f"Removed {count_removed} k-mers with abundance < {min_abund}, current size: {counter.size()}.")
         
         if weighted or not hybrid:
-            hash_to_abundance = counter.get_kmers()
-            out_hashes = np.array(list(hash_to_abundance.keys()))
-            out_abundances = np.array(list(hash_to_abundance.values()))
-            
-            logger.info("Creating output signature.")
-            out_sig = SnipeSig.create_from_hashes_abundances(
-                hashes=out_hashes,
-                abundances=out_abundances,
-                ksize=auto_detected_ksize,
-                scale=auto_detected_scale,
-                name=name,
-            )
+            if exports:
+                out_hashes, out_abundances = counter.export(min_abund=min_abund or 0, drop_singletons=True, sorted=True)
+                logger.info(
+                    f"Exported {len(out_hashes)} of {counter.size()} counted hashes "
+                    f"with abundance >= {max(2, min_abund or 0)}."
+                )
+            elif backend != 'approx':
+                out_hashes = counter.get_hashes_array()
+                out_abundances = counter.get_counts_array()
+            else:
+                out_hashes = np.array(list(hash_to_abundance.keys()))
+                out_abundances = np.array(list(hash_to_abundance.values()))
             
             logger.info(f"Exporting signature to: {output}")
-            out_sig.export(output)
+            write_output_signature(
+                output, out_hashes, out_abundances, auto_detected_ksize, auto_detected_scale, name, threads
+            )
             logger.info("Signature export completed successfully.")
         elif hybrid:
-            hashes = np.array(counter.get_hashes())
-            sample_counts = np.array(counter.get_sample_counts())
-            kmer_dosages = np.array(counter.get_kmer_dosages())
+            hashes, sample_counts, kmer_dosages = counter.get_columns(sorted=True)
             
             assert len(hashes) == len(sample_counts) == len(kmer_dosages)
             
-            logger.info("Creating output signatures.")
-            out_sig1 = SnipeSig.create_from_hashes_abundances(
-                hashes=hashes,
-                abundances=sample_counts,
-                ksize=auto_detected_ksize,
-                scale=auto_detected_scale,
-                name=f"{name}_sample_counts",
+            logger.info(f"Exporting signatures to: {output}")
+            write_output_signature(
+                output.replace('.sig', '_sample_counts.sig'), hashes, sample_counts,
+                auto_detected_ksize, auto_detected_scale, f"{name}_sample_counts", threads
             )
-            out_sig2 = SnipeSig.create_from_hashes_abundances(
-                hashes=hashes,
-                abundances=kmer_dosages,
-                ksize=auto_detected_ksize,
-                scale=auto_detected_scale,
-                name=f"{name}_kmer_dosages",
+            write_output_signature(
+                output.replace('.sig', '_kmer_dosages.sig'), hashes, kmer_dosages,
+                auto_detected_ksize, auto_detected_scale, f"{name}_kmer_dosages", threads
             )
-            
-            logger.info(f"Exporting signatures to: {output}")
-            out_sig1.export(output.replace('.sig', '_sample_counts.sig'))
-            out_sig2.export(output.replace('.sig', '_kmer_dosages.sig'))
             logger.info("Signatures export completed successfully")
         else:
             logger.error("Invalid state.")
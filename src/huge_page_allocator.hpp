@@ -0,0 +1,143 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+
+// Allocator for large hash table backing stores. With 4 KB pages, a table of tens of
+// gigabytes takes a TLB miss on nearly every random probe; backing it with 2 MB (or
+// 1 GB) pages cuts the page walks to almost nothing.
+//
+// Allocations below huge_page_bytes go to operator new. Larger ones get their own
+// anonymous mapping, tried in order of preference:
+//   1. explicit 1 GB hugetlbfs pages, when that wastes at most an eighth of the size,
+//   2. explicit 2 MB hugetlbfs pages,
+//   3. ordinary pages with madvise(MADV_HUGEPAGE), which transparent huge pages back
+//      when enabled ("always" or "madvise" in /sys/kernel/mm/transparent_hugepage).
+// The explicit pools are empty unless an administrator reserved pages (vm.nr_hugepages),
+// in which case those mmap calls fail at once and the next option is used.
+class HugePageMappings
+{
+public:
+    static constexpr size_t huge_page_bytes = size_t(1) << 21;
+    static constexpr size_t gigantic_page_bytes = size_t(1) << 30;
+
+    static void *allocate(size_t bytes)
+    {
+        if (bytes < huge_page_bytes)
+        {
+            return ::operator new(bytes);
+        }
+
+        size_t length = round_up(bytes, gigantic_page_bytes);
+        void *p = MAP_FAILED;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+        if (length - bytes <= bytes / 8)
+        {
+            p = map(length, MAP_HUGETLB | (30 << MAP_HUGE_SHIFT));
+        }
+        if (p == MAP_FAILED)
+        {
+            length = round_up(bytes, huge_page_bytes);
+            p = map(length, MAP_HUGETLB | (21 << MAP_HUGE_SHIFT));
+        }
+#endif
+        if (p == MAP_FAILED)
+        {
+            length = round_up(bytes, huge_page_bytes);
+            p = map(length, 0);
+            if (p == MAP_FAILED)
+            {
+                throw std::bad_alloc();
+            }
+#ifdef MADV_HUGEPAGE
+            ::madvise(p, length, MADV_HUGEPAGE);
+#endif
+        }
+
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry()[p] = length;
+        return p;
+    }
+
+    static void deallocate(void *p, size_t bytes)
+    {
+        if (bytes < huge_page_bytes)
+        {
+            ::operator delete(p);
+            return;
+        }
+        size_t length;
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            auto it = registry().find(p);
+            length = it->second;
+            registry().erase(it);
+        }
+        ::munmap(p, length);
+    }
+
+private:
+    static size_t round_up(size_t bytes, size_t page)
+    {
+        return (bytes + page - 1) / page * page;
+    }
+
+    static void *map(size_t length, int extra_flags)
+    {
+        return ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+    }
+
+    // Mapped length of every live mapping, which depends on the page size that was
+    // granted. Tables allocate rarely (on growth), so one lock is plenty.
+    static std::unordered_map<void *, size_t> &registry()
+    {
+        static std::unordered_map<void *, size_t> mappings;
+        return mappings;
+    }
+
+    static std::mutex &registry_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+};
+
+// Standard allocator interface over HugePageMappings, for the counter maps.
+template <typename T>
+class HugePageAllocator
+{
+public:
+    using value_type = T;
+
+    HugePageAllocator() = default;
+
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(HugePageMappings::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        HugePageMappings::deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U> &) const
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const HugePageAllocator<U> &) const
+    {
+        return false;
+    }
+};
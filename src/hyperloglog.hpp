@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// HyperLogLog distinct counter over 64-bit hashes, with 2^precision one-byte
+// registers (relative error about 1.04 / sqrt(2^precision)).
+class HyperLogLog
+{
+public:
+    explicit HyperLogLog(int precision = 14) : precision(precision), registers(size_t(1) << precision, 0) {}
+
+    void add(uint64_t hash)
+    {
+        // FracMinHash values are below max_hash, so their top bits are zero; remix
+        // them (MurmurHash3's finaliser) before using the top bits as the index.
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+
+        const size_t index = hash >> (64 - precision);
+        const uint64_t rest = (hash << precision) | (uint64_t(1) << (precision - 1));
+        const uint8_t rank = static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+        registers[index] = std::max(registers[index], rank);
+    }
+
+    void merge(const HyperLogLog &other)
+    {
+        for (size_t i = 0; i < registers.size(); i++)
+        {
+            registers[i] = std::max(registers[i], other.registers[i]);
+        }
+    }
+
+    uint64_t estimate() const
+    {
+        const double m = static_cast<double>(registers.size());
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t r : registers)
+        {
+            sum += std::ldexp(1.0, -r);
+            zeros += r == 0;
+        }
+        const double alpha = 0.7213 / (1 + 1.079 / m);
+        double estimate = alpha * m * m / sum;
+
+        // Small cardinalities: linear counting over the empty registers is more accurate.
+        if (estimate <= 2.5 * m && zeros > 0)
+        {
+            estimate = m * std::log(m / static_cast<double>(zeros));
+        }
+        return static_cast<uint64_t>(std::llround(estimate));
+    }
+
+private:
+    int precision;
+    std::vector<uint8_t> registers;
+};
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "hyperloglog.hpp"
+#include "parallel_ingest.hpp"
+#include "sig_reader.hpp"
+
+// Fixed-capacity multi-producer queue. push() blocks while the queue is full, which
+// is what keeps the number of decoded-but-not-yet-counted signatures bounded.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1)) {}
+
+    // Returns false if the queue was closed before the item could be queued.
+    bool push(T &&item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&]
+                      { return closed || items.size() < capacity; });
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Waits for at least one item and moves up to `max_items` of them into `out`.
+    // Returns false once the queue is closed and drained.
+    bool pop_many(std::vector<T> &out, size_t max_items)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&]
+                       { return closed || !items.empty(); });
+        if (items.empty())
+        {
+            return false;
+        }
+        while (!items.empty() && out.size() < max_items)
+        {
+            out.push_back(std::move(items.front()));
+            items.pop_front();
+        }
+        not_full.notify_all();
+        return true;
+    }
+
+    // Wakes every waiter; pending items can still be popped.
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+// Per-stage timings of one add_signature_files call. Loader times are summed over
+// all loader threads. A consumer that mostly idles means decoding is the bottleneck;
+// loaders that mostly block on a full queue mean inserting is.
+struct IngestStats
+{
+    uint64_t signatures = 0;
+    uint64_t hashes = 0;
+    uint32_t loaders = 0;
+    double wall_seconds = 0;
+    double decode_seconds = 0;
+    double loader_blocked_seconds = 0;
+    double insert_seconds = 0;
+    double consumer_idle_seconds = 0;
+};
+
+using ProgressCallback = std::function<void(uint64_t, uint64_t)>;
+
+// Decodes `sources` with a two-stage pipeline: `loaders` threads decode signatures
+// into a queue of at most `queue_size` entries while the calling thread drains it,
+// checks each signature against `params` and hands the batch to `consume`.
+// Signatures reach `consume` in completion order, not input order.
+template <typename Consume>
+IngestStats run_signature_pipeline(const std::vector<SignatureSource> &sources, uint32_t ksize, int loaders,
+                                   size_t queue_size, SketchParams &params, Consume &&consume,
+                                   const ProgressCallback &progress)
+{
+    using clock = std::chrono::steady_clock;
+    const auto seconds_since = [](clock::time_point start)
+    {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    };
+    const clock::time_point wall_start = clock::now();
+
+    IngestStats stats;
+    stats.loaders = static_cast<uint32_t>(std::max<size_t>(1, std::min<size_t>(std::max(loaders, 1), sources.size())));
+    if (queue_size == 0)
+    {
+        queue_size = 2 * static_cast<size_t>(stats.loaders);
+    }
+
+    BoundedQueue<DecodedSignature> queue(queue_size);
+    std::atomic<size_t> next_source{0};
+    std::atomic<size_t> running_loaders{stats.loaders};
+    std::mutex error_mutex;
+    std::exception_ptr loader_error;
+    std::vector<double> decode_seconds(stats.loaders, 0);
+    std::vector<double> blocked_seconds(stats.loaders, 0);
+
+    std::vector<std::thread> workers;
+    workers.reserve(stats.loaders);
+    for (uint32_t w = 0; w < stats.loaders; w++)
+    {
+        workers.emplace_back([&, w]
+                             {
+            try
+            {
+                for (size_t s = next_source++; s < sources.size(); s = next_source++)
+                {
+                    clock::time_point start = clock::now();
+                    DecodedSignature sig = sources[s].read(ksize);
+                    decode_seconds[w] += seconds_since(start);
+
+                    start = clock::now();
+                    const bool queued = queue.push(std::move(sig));
+                    blocked_seconds[w] += seconds_since(start);
+                    if (!queued)
+                    {
+                        break;
+                    }
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!loader_error)
+                {
+                    loader_error = std::current_exception();
+                }
+                queue.close();
+            }
+            if (--running_loaders == 0)
+            {
+                queue.close();
+            } });
+    }
+
+    // Stops and joins the loaders however the consumer loop exits.
+    struct JoinGuard
+    {
+        BoundedQueue<DecodedSignature> &queue;
+        std::vector<std::thread> &workers;
+        ~JoinGuard()
+        {
+            queue.close();
+            for (std::thread &worker : workers)
+            {
+                worker.join();
+            }
+        }
+    } join_guard{queue, workers};
+
+    std::vector<DecodedSignature> batch;
+    while (true)
+    {
+        clock::time_point start = clock::now();
+        batch.clear();
+        const bool more = queue.pop_many(batch, queue_size);
+        stats.consumer_idle_seconds += seconds_since(start);
+        if (!more)
+        {
+            break;
+        }
+
+        start = clock::now();
+        for (const DecodedSignature &sig : batch)
+        {
+            params.check(sig);
+            stats.hashes += sig.hashes.size();
+        }
+        consume(batch);
+        stats.insert_seconds += seconds_since(start);
+        stats.signatures += batch.size();
+
+        if (progress)
+        {
+            progress(stats.signatures, sources.size());
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (loader_error)
+        {
+            std::rethrow_exception(loader_error);
+        }
+    }
+
+    for (uint32_t w = 0; w < stats.loaders; w++)
+    {
+        stats.decode_seconds += decode_seconds[w];
+        stats.loader_blocked_seconds += blocked_seconds[w];
+    }
+    stats.wall_seconds = seconds_since(wall_start);
+    return stats;
+}
+
+// Counts every signature in `paths` (zip collections are expanded member by member)
+// through run_signature_pipeline.
+template <typename Consume>
+IngestStats load_signature_files(const std::vector<std::string> &paths, uint32_t ksize, int loaders,
+                                 size_t queue_size, SketchParams &params, Consume &&consume,
+                                 const ProgressCallback &progress)
+{
+    std::vector<std::unique_ptr<ZipArchive>> archives;
+    const std::vector<SignatureSource> sources = expand_signature_paths(paths, ksize, archives);
+    return run_signature_pipeline(sources, ksize, loaders, queue_size, params, std::forward<Consume>(consume), progress);
+}
+
+// Result of a sizing pre-pass over signature inputs.
+struct CardinalityEstimate
+{
+    // Estimated number of distinct hashes across all signatures.
+    uint64_t distinct = 0;
+    // Sum of the signature sizes, which no count of distinct hashes can exceed.
+    uint64_t upper_bound = 0;
+    uint64_t signatures = 0;
+    double seconds = 0;
+};
+
+// Estimates how many distinct hashes `paths` hold, to size a counter before ingest.
+// Method "hll" decodes every signature into a HyperLogLog sketch; "sum" only adds
+// up signature sizes (read from zip manifests when listed, so those members are not
+// even decompressed) and returns that upper bound as the estimate.
+inline CardinalityEstimate estimate_cardinality(const std::vector<std::string> &paths, uint32_t ksize,
+                                                const std::string &method, int loaders)
+{
+    if (method != "hll" && method != "sum")
+    {
+        throw std::invalid_argument("method must be 'hll' or 'sum'.");
+    }
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::unique_ptr<ZipArchive>> archives;
+    std::vector<SignatureSource> sources = expand_signature_paths(paths, ksize, archives);
+
+    CardinalityEstimate result;
+    result.signatures = sources.size();
+    if (method == "sum")
+    {
+        std::vector<SignatureSource> unknown;
+        for (const SignatureSource &source : sources)
+        {
+            if (source.n_hashes > 0)
+            {
+                result.upper_bound += source.n_hashes;
+            }
+            else
+            {
+                unknown.push_back(source);
+            }
+        }
+        sources.swap(unknown);
+    }
+
+    HyperLogLog sketch;
+    SketchParams params;
+    run_signature_pipeline(
+        sources, ksize, resolve_threads(loaders), 0, params, [&](const std::vector<DecodedSignature> &sigs)
+        {
+            for (const DecodedSignature &sig : sigs)
+            {
+                result.upper_bound += sig.hashes.size();
+                if (method == "hll")
+                {
+                    for (uint64_t hash : sig.hashes)
+                    {
+                        sketch.add(hash);
+                    }
+                }
+            } },
+        ProgressCallback());
+
+    // The sketch's error can overshoot on small inputs; the sum is a hard bound.
+    result.distinct = method == "hll" ? std::min(sketch.estimate(), result.upper_bound) : result.upper_bound;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Incremental MD5 (RFC 1321), for the md5sum field of written signatures. sourmash
+// hashes the decimal ksize followed by every hash in decimal, so update() is called
+// with many short pieces and buffers them into 64-byte blocks.
+class Md5
+{
+public:
+    void update(const char *data, size_t size)
+    {
+        total += size;
+        if (used > 0)
+        {
+            const size_t take = std::min(size, sizeof(block) - used);
+            std::memcpy(block + used, data, take);
+            used += take;
+            data += take;
+            size -= take;
+            if (used < sizeof(block))
+            {
+                return;
+            }
+            transform(block);
+            used = 0;
+        }
+        while (size >= sizeof(block))
+        {
+            transform(reinterpret_cast<const uint8_t *>(data));
+            data += sizeof(block);
+            size -= sizeof(block);
+        }
+        std::memcpy(block, data, size);
+        used = size;
+    }
+
+    void update(const std::string &text)
+    {
+        update(text.data(), text.size());
+    }
+
+    // Lower-case hex digest. Finishes the hash; the object is not reused afterwards.
+    std::string hex_digest()
+    {
+        const uint64_t bits = total * 8;
+        static const char padding[64] = {'\x80'};
+        update(padding, used < 56 ? 56 - used : 120 - used);
+        for (int i = 0; i < 8; i++)
+        {
+            block[56 + i] = static_cast<uint8_t>(bits >> (8 * i));
+        }
+        transform(block);
+
+        static const char hex[] = "0123456789abcdef";
+        std::string digest(32, '0');
+        for (int i = 0; i < 16; i++)
+        {
+            const uint8_t byte = static_cast<uint8_t>(state[i / 4] >> (8 * (i % 4)));
+            digest[2 * i] = hex[byte >> 4];
+            digest[2 * i + 1] = hex[byte & 15];
+        }
+        return digest;
+    }
+
+private:
+    uint32_t state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint8_t block[64];
+    size_t used = 0;
+    uint64_t total = 0;
+
+    static uint32_t rotate(uint32_t x, int s)
+    {
+        return (x << s) | (x >> (32 - s));
+    }
+
+    void transform(const uint8_t *chunk)
+    {
+        static const uint32_t k[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+        static const int shifts[4][4] = {{7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+
+        uint32_t m[16];
+        for (int i = 0; i < 16; i++)
+        {
+            m[i] = uint32_t(chunk[4 * i]) | uint32_t(chunk[4 * i + 1]) << 8 |
+                   uint32_t(chunk[4 * i + 2]) << 16 | uint32_t(chunk[4 * i + 3]) << 24;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 64; i++)
+        {
+            const int round = i / 16;
+            uint32_t f;
+            int g;
+            if (round == 0)
+            {
+                f = (b & c) | (~b & d);
+                g = i;
+            }
+            else if (round == 1)
+            {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            }
+            else if (round == 2)
+            {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            }
+            else
+            {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            const uint32_t next = b + rotate(a + f + k[i] + m[g], shifts[round][i % 4]);
+            a = d;
+            d = c;
+            c = b;
+            b = next;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+};
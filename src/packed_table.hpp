@@ -0,0 +1,362 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Splits hashes no larger than max_hash into a bucket prefix (their top bits) and
+// the remainder stored in the bucket's table. FracMinHash values at scale S are
+// below 2^64 / S, so their top log2(S) bits are zero and are not stored at all.
+struct PrefixLayout
+{
+    static constexpr int max_remainder_bits = 40;
+    static constexpr int max_prefix_bits = 20;
+
+    int key_bits = 0;
+    int prefix_bits = 0;
+    int remainder_bits = 0;
+
+    PrefixLayout() = default;
+
+    explicit PrefixLayout(uint64_t max_hash)
+    {
+        key_bits = max_hash == 0 ? 1 : 64 - __builtin_clzll(max_hash);
+        // At least 2^10 buckets when the keys allow it, so inserts spread over workers.
+        prefix_bits = std::max(key_bits - max_remainder_bits, std::min(key_bits, 10));
+        remainder_bits = key_bits - prefix_bits;
+        if (prefix_bits > max_prefix_bits)
+        {
+            throw std::invalid_argument("Hashes of " + std::to_string(key_bits) +
+                                        " bits need too many buckets; use a scale of at least 16.");
+        }
+    }
+
+    size_t n_buckets() const
+    {
+        return size_t(1) << prefix_bits;
+    }
+
+    uint64_t max_key() const
+    {
+        return key_bits == 64 ? ~uint64_t(0) : (uint64_t(1) << key_bits) - 1;
+    }
+
+    size_t bucket(uint64_t key) const
+    {
+        return static_cast<size_t>(key >> remainder_bits);
+    }
+
+    uint64_t remainder(uint64_t key) const
+    {
+        return key & ((uint64_t(1) << remainder_bits) - 1);
+    }
+
+    uint64_t key(size_t bucket, uint64_t remainder) const
+    {
+        return (static_cast<uint64_t>(bucket) << remainder_bits) | remainder;
+    }
+};
+
+// Linear-probing table of 64-bit words, each packing a key remainder of up to 40
+// bits above a 24-bit saturating count. Stored counts are at least 1, so the
+// all-zero word marks an empty slot. The low remainder bits pick the home slot,
+// which is fine for FracMinHash values: their low bits are uniform.
+class PackedCountTable
+{
+public:
+    static constexpr int count_bits = 24;
+    static constexpr uint32_t max_count = (uint32_t(1) << count_bits) - 1;
+
+    void add(uint64_t remainder, uint32_t n = 1)
+    {
+        if ((used + 1) * 5 > slots.size() * 4)
+        {
+            rehash(std::max<size_t>(16, slots.size() * 2));
+        }
+        const size_t mask = slots.size() - 1;
+        for (size_t i = remainder & mask;; i = (i + 1) & mask)
+        {
+            const uint64_t word = slots[i];
+            if (word == 0)
+            {
+                slots[i] = (remainder << count_bits) | std::min(n, max_count);
+                used++;
+                return;
+            }
+            if ((word >> count_bits) == remainder)
+            {
+                const uint64_t count = std::min<uint64_t>((word & max_count) + n, max_count);
+                slots[i] = (word & ~uint64_t(max_count)) | count;
+                return;
+            }
+        }
+    }
+
+    void prefetch(uint64_t remainder) const
+    {
+        if (!slots.empty())
+        {
+            __builtin_prefetch(&slots[remainder & (slots.size() - 1)]);
+        }
+    }
+
+    // Sizes the table so `n` entries fit without growing.
+    void reserve(size_t n)
+    {
+        size_t capacity = 16;
+        while (n * 5 > capacity * 4)
+        {
+            capacity *= 2;
+        }
+        if (capacity > slots.size())
+        {
+            rehash(capacity);
+        }
+    }
+
+    size_t size() const
+    {
+        return used;
+    }
+
+    size_t bytes() const
+    {
+        return slots.size() * sizeof(uint64_t);
+    }
+
+    // Calls f(remainder, count) for every entry.
+    template <typename F>
+    void for_each(F &&f) const
+    {
+        for (uint64_t word : slots)
+        {
+            if (word != 0)
+            {
+                f(word >> count_bits, static_cast<uint32_t>(word & max_count));
+            }
+        }
+    }
+
+    // Drops the entries whose count fails `keep` and returns how many were dropped.
+    // Linear probing cannot leave holes behind, so the survivors are reinserted.
+    template <typename Keep>
+    size_t filter(Keep &&keep)
+    {
+        std::vector<uint64_t> kept;
+        for (uint64_t word : slots)
+        {
+            if (word != 0 && keep(static_cast<uint32_t>(word & max_count)))
+            {
+                kept.push_back(word);
+            }
+        }
+        const size_t removed = used - kept.size();
+        slots.clear();
+        slots.shrink_to_fit();
+        used = 0;
+        if (!kept.empty())
+        {
+            reserve(kept.size());
+        }
+        for (uint64_t word : kept)
+        {
+            add(word >> count_bits, static_cast<uint32_t>(word & max_count));
+        }
+        return removed;
+    }
+
+private:
+    std::vector<uint64_t> slots;
+    size_t used = 0;
+
+    void rehash(size_t capacity)
+    {
+        std::vector<uint64_t> old(capacity, 0);
+        old.swap(slots);
+        used = 0;
+        for (uint64_t word : old)
+        {
+            if (word != 0)
+            {
+                add(word >> count_bits, static_cast<uint32_t>(word & max_count));
+            }
+        }
+    }
+};
+
+// Linear-probing table like PackedCountTable that also accumulates a Payload per
+// entry (with +=), stored in the same slot: the packed word is split into two 32-bit
+// halves so a slot with a 4-byte payload takes 12 bytes and one cache line.
+//
+// Capacities are not rounded to powers of two (the home slot comes from a
+// multiply-shift of the remainder) and grow by half, so the load factor
+// stays between about 0.57 and 0.85 instead of dropping to 0.4 after a doubling.
+// Each growth rehashes the table, so callers that can should reserve() up front.
+template <typename Payload>
+class PackedPayloadTable
+{
+public:
+    static constexpr int count_bits = PackedCountTable::count_bits;
+    static constexpr uint32_t max_count = PackedCountTable::max_count;
+
+    void add(uint64_t remainder, uint32_t n, const Payload &payload)
+    {
+        if ((used + 1) * 20 > slots.size() * 17)
+        {
+            rehash(std::max<size_t>(16, slots.size() + slots.size() / 2));
+        }
+        for (size_t i = home(remainder);; i = next(i))
+        {
+            Slot &slot = slots[i];
+            const uint64_t word = slot.word();
+            if (word == 0)
+            {
+                slot.set_word((remainder << count_bits) | std::min(n, max_count));
+                slot.payload = payload;
+                used++;
+                return;
+            }
+            if ((word >> count_bits) == remainder)
+            {
+                const uint64_t count = std::min<uint64_t>((word & max_count) + n, max_count);
+                slot.set_word((word & ~uint64_t(max_count)) | count);
+                slot.payload += payload;
+                return;
+            }
+        }
+    }
+
+    void prefetch(uint64_t remainder) const
+    {
+        if (!slots.empty())
+        {
+            __builtin_prefetch(&slots[home(remainder)]);
+        }
+    }
+
+    // Sizes the table so `n` entries fit without growing.
+    void reserve(size_t n)
+    {
+        const size_t capacity = std::max<size_t>(16, n * 20 / 17 + 1);
+        if (capacity > slots.size())
+        {
+            rehash(capacity);
+        }
+    }
+
+    size_t size() const
+    {
+        return used;
+    }
+
+    size_t bytes() const
+    {
+        return slots.size() * sizeof(Slot);
+    }
+
+    // Calls f(remainder, count, payload) for every entry.
+    template <typename F>
+    void for_each(F &&f) const
+    {
+        for (const Slot &slot : slots)
+        {
+            const uint64_t word = slot.word();
+            if (word != 0)
+            {
+                f(word >> count_bits, static_cast<uint32_t>(word & max_count), slot.payload);
+            }
+        }
+    }
+
+    // Drops the entries for which keep(count, payload) is false and returns how many
+    // were dropped; `keep` gets the payload by reference and may update it.
+    template <typename Keep>
+    size_t filter(Keep &&keep)
+    {
+        std::vector<Slot> kept;
+        for (Slot &slot : slots)
+        {
+            const uint64_t word = slot.word();
+            if (word != 0 && keep(static_cast<uint32_t>(word & max_count), slot.payload))
+            {
+                kept.push_back(slot);
+            }
+        }
+        const size_t removed = used - kept.size();
+        slots.clear();
+        slots.shrink_to_fit();
+        used = 0;
+        if (!kept.empty())
+        {
+            reserve(kept.size());
+        }
+        for (const Slot &slot : kept)
+        {
+            place(slot);
+        }
+        return removed;
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t low = 0;
+        uint32_t high = 0;
+        Payload payload = Payload();
+
+        uint64_t word() const
+        {
+            return (static_cast<uint64_t>(high) << 32) | low;
+        }
+
+        void set_word(uint64_t word)
+        {
+            low = static_cast<uint32_t>(word);
+            high = static_cast<uint32_t>(word >> 32);
+        }
+    };
+
+    std::vector<Slot> slots;
+    size_t used = 0;
+
+    // Fibonacci hashing spreads remainders of any width over 32 bits, which then
+    // scale to the capacity.
+    size_t home(uint64_t remainder) const
+    {
+        return static_cast<size_t>((((remainder * 0x9e3779b97f4a7c15ULL) >> 32) * slots.size()) >> 32);
+    }
+
+    size_t next(size_t i) const
+    {
+        return i + 1 == slots.size() ? 0 : i + 1;
+    }
+
+    // Stores an entry known to be absent.
+    void place(const Slot &entry)
+    {
+        size_t i = home(entry.word() >> count_bits);
+        while (slots[i].word() != 0)
+        {
+            i = next(i);
+        }
+        slots[i] = entry;
+        used++;
+    }
+
+    void rehash(size_t capacity)
+    {
+        std::vector<Slot> old(capacity);
+        old.swap(slots);
+        used = 0;
+        for (const Slot &slot : old)
+        {
+            if (slot.word() != 0)
+            {
+                place(slot);
+            }
+        }
+    }
+};
@@ -0,0 +1,359 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <numeric>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <parallel_hashmap/phmap.h>
+
+// Maps the user-facing `threads` knob to a worker count: anything below 1 means
+// "all available cores". Without OpenMP every parallel region runs serially.
+inline int resolve_threads(int threads)
+{
+#ifdef _OPENMP
+    return threads < 1 ? omp_get_max_threads() : threads;
+#else
+    (void)threads;
+    return 1;
+#endif
+}
+
+// Decoding threads for add_signature_files when the caller asks for `loaders` < 1:
+// half of the counter's (resolved) `threads`, since the loaders run alongside that
+// many insert workers and the two together should not oversubscribe the cores.
+inline int default_loaders(int loaders, int threads)
+{
+    return loaders < 1 ? std::max(1, threads / 2) : loaders;
+}
+
+// Runs f(i) for i in [0, n) across `threads` workers. An exception cannot leave an
+// OpenMP region, so the first one thrown is kept and rethrown once all are done.
+template <typename F>
+void parallel_for_each_index(size_t n, int threads, F &&f)
+{
+    std::exception_ptr error;
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (ptrdiff_t i = 0; i < static_cast<ptrdiff_t>(n); i++)
+    {
+        try
+        {
+            f(static_cast<size_t>(i));
+        }
+        catch (...)
+        {
+#pragma omp critical(parallel_for_each_index_error)
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+// A contiguous run of input hashes (usually one sample) fed to the ingest kernel.
+struct HashBatch
+{
+    const uint64_t *hashes;
+    size_t size;
+};
+
+// An input hash routed to its destination submap, remembering where it came from
+// so the update callback can look up per-hash data such as abundances.
+struct RoutedHash
+{
+    uint64_t hashval;
+    uint32_t batch;
+    uint32_t index;
+};
+
+// How many routed hashes ahead of the one being applied have their probe prefetched;
+// enough to cover DRAM latency without evicting the lines before they are used.
+constexpr size_t prefetch_distance = 16;
+
+// Inputs smaller than this are not worth routing.
+constexpr size_t min_slice = size_t(1) << 16;
+
+inline size_t total_batch_size(const std::vector<HashBatch> &batches)
+{
+    size_t total = 0;
+    for (const HashBatch &batch : batches)
+    {
+        if (batch.size > std::numeric_limits<uint32_t>::max())
+        {
+            throw std::length_error("a single batch cannot hold more than 2^32 hashes.");
+        }
+        total += batch.size;
+    }
+    return total;
+}
+
+// Routes every hash of `batches` to one of `n_parts` independent partitions of a
+// table and applies each partition on a single worker.
+//
+// `hash_of(key)` gives the value stored in RoutedHash::hashval and `part_of(hashval)`
+// the partition. The input is bucketed by partition stably, so each partition sees
+// its hashes in input order, then `apply(part, begin, end)` runs once per non-empty
+// partition over its RoutedHash range; partitions are spread across `threads`
+// workers, so no two workers ever touch the same partition.
+template <typename HashOf, typename PartOf, typename Apply>
+void partitioned_apply(const std::vector<HashBatch> &batches, size_t n_parts, int threads, HashOf &&hash_of,
+                       PartOf &&part_of, Apply &&apply)
+{
+    const size_t total = total_batch_size(batches);
+    if (total == 0)
+    {
+        return;
+    }
+    threads = std::max(threads, 1);
+
+    // Cut the input into slices so one large sample is also spread across workers.
+    struct Slice
+    {
+        uint32_t batch;
+        size_t begin;
+        size_t end;
+    };
+
+    const size_t slice_len = std::max(min_slice, (total + threads * 4 - 1) / (threads * 4));
+    std::vector<Slice> slices;
+    for (size_t b = 0; b < batches.size(); b++)
+    {
+        for (size_t begin = 0; begin < batches[b].size; begin += slice_len)
+        {
+            slices.push_back({static_cast<uint32_t>(b), begin, std::min(batches[b].size, begin + slice_len)});
+        }
+    }
+
+    const ptrdiff_t n_slices = static_cast<ptrdiff_t>(slices.size());
+    std::vector<size_t> offsets(slices.size() * n_parts, 0);
+
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (ptrdiff_t s = 0; s < n_slices; s++)
+    {
+        const Slice &slice = slices[s];
+        const uint64_t *hashes = batches[slice.batch].hashes;
+        size_t *counts = &offsets[s * n_parts];
+        for (size_t i = slice.begin; i < slice.end; i++)
+        {
+            counts[part_of(hash_of(hashes[i]))]++;
+        }
+    }
+
+    // Turn the per-slice counts into write offsets, grouped partition by partition.
+    std::vector<size_t> part_begin(n_parts + 1, 0);
+    size_t position = 0;
+    for (size_t part = 0; part < n_parts; part++)
+    {
+        part_begin[part] = position;
+        for (size_t s = 0; s < slices.size(); s++)
+        {
+            const size_t count = offsets[s * n_parts + part];
+            offsets[s * n_parts + part] = position;
+            position += count;
+        }
+    }
+    part_begin[n_parts] = position;
+
+    std::vector<RoutedHash> routed(total);
+
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (ptrdiff_t s = 0; s < n_slices; s++)
+    {
+        const Slice &slice = slices[s];
+        const uint64_t *hashes = batches[slice.batch].hashes;
+        size_t *cursor = &offsets[s * n_parts];
+        for (size_t i = slice.begin; i < slice.end; i++)
+        {
+            const size_t hashval = hash_of(hashes[i]);
+            routed[cursor[part_of(hashval)]++] = {hashval, slice.batch, static_cast<uint32_t>(i)};
+        }
+    }
+
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (ptrdiff_t part = 0; part < static_cast<ptrdiff_t>(n_parts); part++)
+    {
+        if (part_begin[part] != part_begin[part + 1])
+        {
+            apply(static_cast<size_t>(part), routed.data() + part_begin[part], routed.data() + part_begin[part + 1]);
+        }
+    }
+}
+
+// Inserts every hash of `batches` into a phmap parallel map.
+//
+// Small inputs are applied directly in input order. Larger ones go through
+// partitioned_apply with the map's submaps as partitions, so each worker applies
+// whole submaps under a single lock acquisition and inserts do not contend. Within
+// a submap the probe of the hash `prefetch_distance` entries ahead is prefetched,
+// so many cache misses are in flight at once instead of one.
+//
+// `update(set, hashval, batch, index)` receives the submap's embedded set and must
+// insert or update batches[batch].hashes[index] using the precomputed hash value.
+// `prefetch(hashval, batch, index)`, when given, is called alongside the probe
+// prefetch for any other memory `update` will touch for that hash.
+struct NoPrefetch
+{
+    void operator()(size_t, uint32_t, uint32_t) const {}
+};
+
+template <typename Map, typename Update, typename Prefetch = NoPrefetch>
+void partitioned_ingest(Map &map, const std::vector<HashBatch> &batches, int threads, Update &&update,
+                        Prefetch &&prefetch = Prefetch())
+{
+    if (total_batch_size(batches) < min_slice)
+    {
+        for (size_t b = 0; b < batches.size(); b++)
+        {
+            const HashBatch &batch = batches[b];
+            for (size_t i = 0; i < batch.size; i++)
+            {
+                const size_t hashval = map.hash(batch.hashes[i]);
+                map.with_submap_m(Map::subidx(hashval), [&](auto &set)
+                                  { update(set, hashval, static_cast<uint32_t>(b), static_cast<uint32_t>(i)); });
+            }
+        }
+        return;
+    }
+
+    partitioned_apply(
+        batches, Map::subcnt(), threads, [&](uint64_t key)
+        { return map.hash(key); },
+        [](size_t hashval)
+        { return Map::subidx(hashval); },
+        [&](size_t sub, const RoutedHash *begin, const RoutedHash *end)
+        {
+            map.with_submap_m(sub, [&](auto &set)
+                              {
+                const RoutedHash *warmup_end = begin + std::min<size_t>(end - begin, prefetch_distance);
+                for (const RoutedHash *r = begin; r < warmup_end; r++)
+                {
+                    set.prefetch_hash(r->hashval);
+                    prefetch(r->hashval, r->batch, r->index);
+                }
+                for (const RoutedHash *r = begin; r < end; r++)
+                {
+                    if (static_cast<size_t>(end - r) > prefetch_distance)
+                    {
+                        const RoutedHash &ahead = r[prefetch_distance];
+                        set.prefetch_hash(ahead.hashval);
+                        prefetch(ahead.hashval, ahead.batch, ahead.index);
+                    }
+                    update(set, r->hashval, r->batch, r->index);
+                } });
+        });
+}
+
+// Returns the value stored for `key` in a submap, value-initialising it on first
+// sight. `hashval` must be the parent map's hash of `key`.
+template <typename Set>
+typename Set::value_type::second_type &submap_value(Set &set, uint64_t key, size_t hashval)
+{
+    return set.lazy_emplace_with_hash(key, hashval, [&](const typename Set::constructor &ctor)
+                                      { ctor(key, typename Set::value_type::second_type()); })
+        ->second;
+}
+
+// Number of entries held by each submap of a phmap parallel map; a skewed spread
+// means the hasher feeds `subidx` poorly and workers wait on the busiest submaps.
+template <typename Map>
+std::vector<size_t> submap_sizes(const Map &map)
+{
+    std::vector<size_t> sizes(Map::subcnt());
+    for (size_t sub = 0; sub < sizes.size(); sub++)
+    {
+        map.with_submap(sub, [&](const auto &set)
+                        { sizes[sub] = set.size(); });
+    }
+    return sizes;
+}
+
+// Entries in a phmap parallel map, counted under each submap's lock (phmap's size()
+// reads the submaps without it).
+template <typename Map>
+size_t locked_size(const Map &map)
+{
+    const std::vector<size_t> sizes = submap_sizes(map);
+    return std::accumulate(sizes.begin(), sizes.end(), size_t(0));
+}
+
+// Erases every entry of a phmap parallel map for which `drop(entry)` is true and
+// returns how many went. Submaps are spread across `threads` workers, each running
+// phmap's erase_if over one submap under its write lock; `drop` may also update the
+// entries it keeps.
+template <typename Map, typename Drop>
+uint64_t parallel_erase_if(Map &map, int threads, Drop &&drop)
+{
+    std::vector<uint64_t> erased(Map::subcnt(), 0);
+    parallel_for_each_index(Map::subcnt(), threads, [&](size_t sub)
+                            { map.with_submap_m(sub, [&](auto &set)
+                                                { erased[sub] = phmap::priv::erase_if(set, drop); }); });
+    return std::accumulate(erased.begin(), erased.end(), uint64_t(0));
+}
+
+// Copies the entries of a phmap parallel map that pass `keep(entry)` out as rows of
+// caller-owned columns, in submap order, leaving the map as it is. A first parallel
+// pass counts each submap's survivors, `allocate(total)` sizes the columns once, and a
+// second pass calls `write(entry, row)` with every submap filling its own range. Each
+// pass holds a submap's read lock while on it. An entry that starts passing between
+// the passes is left out; rows missing because an entry was erased in between are
+// closed up with `move_row(from, to)`. Returns the number of rows.
+template <typename Map, typename Keep, typename Allocate, typename Write, typename MoveRow>
+size_t parallel_export_if(const Map &map, int threads, Keep &&keep, Allocate &&allocate, Write &&write,
+                          MoveRow &&move_row)
+{
+    const size_t n_subs = Map::subcnt();
+    std::vector<size_t> offsets(n_subs + 1, 0);
+    parallel_for_each_index(n_subs, threads, [&](size_t sub)
+                            { map.with_submap(sub, [&](const auto &set)
+                                              {
+                size_t n = 0;
+                for (const auto &entry : set)
+                {
+                    n += keep(entry) ? 1 : 0;
+                }
+                offsets[sub + 1] = n; }); });
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    allocate(offsets[n_subs]);
+
+    std::vector<size_t> written(n_subs, 0);
+    parallel_for_each_index(n_subs, threads, [&](size_t sub)
+                            { map.with_submap(sub, [&](const auto &set)
+                                              {
+                size_t row = offsets[sub];
+                for (auto it = set.begin(); it != set.end() && row < offsets[sub + 1]; ++it)
+                {
+                    if (keep(*it))
+                    {
+                        write(*it, row++);
+                    }
+                }
+                written[sub] = row - offsets[sub]; }); });
+
+    size_t rows = 0;
+    for (size_t sub = 0; sub < n_subs; sub++)
+    {
+        if (rows == offsets[sub])
+        {
+            rows += written[sub];
+            continue;
+        }
+        for (size_t i = 0; i < written[sub]; i++)
+        {
+            move_row(offsets[sub] + i, rows++);
+        }
+    }
+    return rows;
+}
@@ -1,257 +1,2545 @@
 #include <nanobind/nanobind.h>
+#include <nanobind/ndarray.h>
+#include <atomic>
+#include <cmath>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <nanobind/stl/string.h>
 #include <nanobind/stl/vector.h>
 #include <nanobind/stl/unordered_map.h>
-#include <parallel_hashmap/phmap.h>
+#include <nanobind/stl/function.h>
+#include <nanobind/stl/tuple.h>
 #include <mutex>
+#include "blocked_bloom.hpp"
+#include "count_min_sketch.hpp"
+#include "hashers.hpp"
+#include "huge_page_allocator.hpp"
+#include "parallel_ingest.hpp"
+#include "ingest_pipeline.hpp"
+#include "packed_table.hpp"
+#include "radix_sort.hpp"
+#include "score_format.hpp"
+#include "sig_writer.hpp"
+#include "small_count_table.hpp"
+#include "sorted_runs.hpp"
+#include "spill_files.hpp"
 
 namespace nb = nanobind;
 using namespace std;
 
-class HashesCounter
+// Read-only views over the NumPy buffers held by SnipeSig; nanobind hands us the
+// underlying memory directly instead of copying it into a std::vector.
+using HashArray = nb::ndarray<const uint64_t, nb::ndim<1>, nb::c_contig, nb::device::cpu>;
+
+template <typename T>
+using AbundanceArray = nb::ndarray<const T, nb::ndim<1>, nb::c_contig, nb::device::cpu>;
+
+template <typename T>
+static void check_same_size(const HashArray &hashes, const AbundanceArray<T> &abundances)
+{
+    if (hashes.shape(0) != abundances.shape(0))
+    {
+        throw std::invalid_argument("hashes and abundances arrays must be of the same size.");
+    }
+}
+
+// Abundances of one sample, aligned with the HashBatch at the same position.
+template <typename T>
+struct AbundanceBatch
+{
+    const T *abundances;
+    float inv_mean_abundance;
+};
+
+static vector<HashBatch> to_batches(const vector<HashArray> &hashes)
+{
+    vector<HashBatch> batches;
+    batches.reserve(hashes.size());
+    for (const HashArray &sample : hashes)
+    {
+        batches.push_back({sample.data(), sample.shape(0)});
+    }
+    return batches;
+}
+
+static vector<HashBatch> to_batches(const vector<DecodedSignature> &sigs)
+{
+    vector<HashBatch> batches;
+    batches.reserve(sigs.size());
+    for (const DecodedSignature &sig : sigs)
+    {
+        batches.push_back({sig.hashes.data(), sig.hashes.size()});
+    }
+    return batches;
+}
+
+static vector<AbundanceBatch<uint32_t>> to_abundance_batches(const vector<DecodedSignature> &sigs)
+{
+    vector<AbundanceBatch<uint32_t>> batches;
+    batches.reserve(sigs.size());
+    for (const DecodedSignature &sig : sigs)
+    {
+        if (sig.abundances.size() != sig.hashes.size())
+        {
+            throw std::invalid_argument("Signature '" + sig.source + "' does not track abundances.");
+        }
+        batches.push_back({sig.abundances.data(), 1.0f / sig.mean_abundance()});
+    }
+    return batches;
+}
+
+template <typename T>
+static vector<AbundanceBatch<T>> to_abundance_batches(const vector<HashArray> &hashes,
+                                                      const vector<AbundanceArray<T>> &abundances,
+                                                      const vector<float> &mean_abundances)
+{
+    if (hashes.size() != abundances.size() || hashes.size() != mean_abundances.size())
+    {
+        throw std::invalid_argument("hashes, abundances and mean_abundances must have the same number of samples.");
+    }
+
+    vector<AbundanceBatch<T>> batches;
+    batches.reserve(abundances.size());
+    for (size_t b = 0; b < abundances.size(); b++)
+    {
+        check_same_size(hashes[b], abundances[b]);
+        batches.push_back({abundances[b].data(), 1.0f / mean_abundances[b]}); // Precompute reciprocal for faster division
+    }
+    return batches;
+}
+
+// One column of exported rows (hashes, counts, ...), in a buffer NumPy takes over.
+template <typename T>
+struct Column
+{
+    unique_ptr<T[]> data;
+    size_t size = 0;
+
+    void allocate(size_t n)
+    {
+        data.reset(new T[n]);
+        size = n;
+    }
+};
+
+// A column and how its value is read from a map entry, for export_rows.
+template <typename T, typename ValueOf>
+struct ColumnField
+{
+    Column<T> &column;
+    ValueOf value_of;
+};
+
+template <typename T, typename ValueOf>
+static ColumnField<T, ValueOf> field(Column<T> &column, ValueOf value_of)
+{
+    return {column, value_of};
+}
+
+// (hashes, counts) as returned by export() and get_*_array().
+using CountColumns = std::tuple<Column<uint64_t>, Column<uint32_t>>;
+
+// (hashes, sample counts, rounded dosages) from the hybrid counters' get_columns().
+using HybridColumns = std::tuple<Column<uint64_t>, Column<uint32_t>, Column<uint32_t>>;
+
+template <typename T>
+static Column<T> column_of(const vector<T> &values)
+{
+    Column<T> column;
+    column.allocate(values.size());
+    std::copy(values.begin(), values.end(), column.data.get());
+    return column;
+}
+
+// Reorders `hashes`, and the columns aligned with it, by increasing hash.
+template <typename... T>
+static void sort_by_hash(int threads, Column<uint64_t> &hashes, Column<T> &...values)
+{
+    using Row = std::tuple<uint64_t, T...>;
+    const vector<Row> rows = msd_radix_sort<Row>(hashes.size, threads, [&](size_t i)
+                                                 { return Row(hashes.data[i], values.data[i]...); });
+#pragma omp parallel for num_threads(threads) schedule(static)
+    for (ptrdiff_t i = 0; i < static_cast<ptrdiff_t>(rows.size()); i++)
+    {
+        std::tie(hashes.data[i], values.data[i]...) = rows[i];
+    }
+}
+
+// Serial sort_by_hash of rows [begin, end), for parts that are already in key order
+// relative to each other.
+template <typename... T>
+static void sort_range_by_hash(size_t begin, size_t end, Column<uint64_t> &hashes, Column<T> &...values)
+{
+    using Row = std::tuple<uint64_t, T...>;
+    vector<Row> rows;
+    rows.reserve(end - begin);
+    for (size_t i = begin; i < end; i++)
+    {
+        rows.emplace_back(hashes.data[i], values.data[i]...);
+    }
+    std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b)
+              { return std::get<0>(a) < std::get<0>(b); });
+    for (size_t i = begin; i < end; i++)
+    {
+        std::tie(hashes.data[i], values.data[i]...) = rows[i - begin];
+    }
+}
+
+template <typename... T>
+static void sort_by_hash(int threads, std::tuple<Column<uint64_t>, Column<T>...> &columns)
+{
+    std::apply([&](Column<uint64_t> &hashes, Column<T> &...values)
+               { sort_by_hash(threads, hashes, values...); },
+               columns);
+}
+
+// Writes a signature straight from hash and abundance arrays (see write_signature in
+// sig_writer.hpp). Rows that are not in hash order are sorted on a copy first.
+static void write_signature_arrays(const string &path, const HashArray &hashes,
+                                   const AbundanceArray<uint32_t> &abundances, uint32_t ksize, uint64_t scale,
+                                   const string &name, const string &filename, bool md5sum, int compression,
+                                   int threads)
+{
+    check_same_size(hashes, abundances);
+    const size_t n = hashes.shape(0);
+    SignatureHeader header;
+    header.name = name;
+    header.filename = filename;
+    header.ksize = ksize;
+    header.scale = scale;
+    if (std::is_sorted(hashes.data(), hashes.data() + n))
+    {
+        write_signature(path, header, hashes.data(), abundances.data(), n, md5sum, compression);
+        return;
+    }
+
+    Column<uint64_t> sorted_hashes;
+    Column<uint32_t> sorted_abundances;
+    sorted_hashes.allocate(n);
+    sorted_abundances.allocate(n);
+    std::copy(hashes.data(), hashes.data() + n, sorted_hashes.data.get());
+    std::copy(abundances.data(), abundances.data() + n, sorted_abundances.data.get());
+    sort_by_hash(threads, sorted_hashes, sorted_abundances);
+    write_signature(path, header, sorted_hashes.data.get(), sorted_abundances.data.get(), n, md5sum, compression);
+}
+
+// Row selectors for export_rows.
+static constexpr auto every_entry = [](const auto &)
+{ return true; };
+static constexpr auto entry_key = [](const auto &entry)
+{ return static_cast<uint64_t>(entry.first); };
+
+// Exports the entries of a counter map that pass `keep` as rows of `fields`, with
+// parallel_export_if; the map is not modified.
+template <typename Map, typename Keep, typename... Fields>
+static void export_rows(const Map &map, int threads, Keep &&keep, Fields... fields)
+{
+    const size_t rows = parallel_export_if(
+        map, threads, keep, [&](size_t n)
+        { (fields.column.allocate(n), ...); },
+        [&](const typename Map::value_type &entry, size_t row)
+        { ((fields.column.data[row] = fields.value_of(entry)), ...); },
+        [&](size_t from, size_t to)
+        { ((fields.column.data[to] = fields.column.data[from]), ...); });
+    ((fields.column.size = rows), ...);
+}
+
+// Calls f(entry) for every entry of a counter map, one submap at a time under its
+// lock, so a call that rehashes a submap waits rather than moving entries under the walk.
+template <typename Map, typename F>
+static void for_each_entry(const Map &map, F &&f)
+{
+    for (size_t sub = 0; sub < Map::subcnt(); sub++)
+    {
+        map.with_submap(sub, [&](const auto &set)
+                        {
+            for (const auto &entry : set)
+            {
+                f(entry);
+            } });
+    }
+}
+
+// Exports a counter made of independent parts (buckets, partitions). Part p holds
+// size_of(p) rows; once `columns` are allocated for all of them, fill(p, first_row)
+// writes that part's rows from first_row on, one part per worker.
+template <typename SizeOf, typename Fill, typename... T>
+static void export_parts(size_t n_parts, int threads, SizeOf &&size_of, Fill &&fill, Column<T> &...columns)
+{
+    vector<size_t> offsets(n_parts + 1, 0);
+    for (size_t p = 0; p < n_parts; p++)
+    {
+        offsets[p + 1] = offsets[p] + size_of(p);
+    }
+    (columns.allocate(offsets[n_parts]), ...);
+    parallel_for_each_index(n_parts, threads, [&](size_t p)
+                            { fill(p, offsets[p]); });
+}
+
+// export_parts for fills that keep only some of a part's rows: fill(p, first_row)
+// returns how many it wrote, and the rows are then closed up in part order, as in
+// parallel_export_if. Returns the number of rows kept.
+template <typename SizeOf, typename Fill, typename... T>
+static size_t export_parts_if(size_t n_parts, int threads, SizeOf &&size_of, Fill &&fill, Column<T> &...columns)
+{
+    vector<size_t> offsets(n_parts + 1, 0);
+    for (size_t p = 0; p < n_parts; p++)
+    {
+        offsets[p + 1] = offsets[p] + size_of(p);
+    }
+    (columns.allocate(offsets[n_parts]), ...);
+    vector<size_t> written(n_parts, 0);
+    parallel_for_each_index(n_parts, threads, [&](size_t p)
+                            { written[p] = fill(p, offsets[p]); });
+
+    size_t rows = 0;
+    for (size_t p = 0; p < n_parts; p++)
+    {
+        if (rows != offsets[p])
+        {
+            for (size_t i = 0; i < written[p]; i++)
+            {
+                ((columns.data[rows + i] = columns.data[offsets[p] + i]), ...);
+            }
+        }
+        rows += written[p];
+    }
+    ((columns.size = rows), ...);
+    return rows;
+}
+
+template <typename Hash, template <typename> class Allocator = std::allocator, typename Mutex = std::mutex>
+class BasicHashesCounter
+{
+private:
+    using Map = CounterMap<uint32_t, Hash, Allocator, Mutex>;
+
+    Map hash_to_count;
+
+    // Optional singleton screen: one Bloom filter and pair of tallies per submap, each
+    // touched only by the worker holding that submap.
+    vector<BlockedBloomFilter> screen;
+    vector<uint64_t> first_sightings;
+    vector<uint64_t> promoted;
+
+    int threads;
+    SketchParams sketch;
+
+    static uint32_t count_of(const typename Map::value_type &entry)
+    {
+        return entry.second;
+    }
+
+public:
+    BasicHashesCounter(int threads = 1) : threads(resolve_threads(threads)) {}
+
+    void ingest(const vector<HashBatch> &batches)
+    {
+        if (screen.empty())
+        {
+            partitioned_ingest(hash_to_count, batches, threads,
+                               [&](auto &set, size_t hashval, uint32_t b, uint32_t i)
+                               { submap_value(set, batches[b].hashes[i], hashval)++; });
+            return;
+        }
+
+        // A first sighting only sets filter bits; the hash enters the map when seen
+        // again, with the count both sightings add up to.
+        partitioned_ingest(hash_to_count, batches, threads,
+                           [&](auto &set, size_t hashval, uint32_t b, uint32_t i)
+                           {
+                               const size_t sub = Map::subidx(hashval);
+                               if (!screen[sub].test_and_set(batches[b].hashes[i]))
+                               {
+                                   first_sightings[sub]++;
+                                   return;
+                               }
+                               uint32_t &count = submap_value(set, batches[b].hashes[i], hashval);
+                               if (count == 0)
+                               {
+                                   promoted[sub]++;
+                                   count = 2;
+                               }
+                               else
+                               {
+                                   count++;
+                               }
+                           },
+                           [&](size_t hashval, uint32_t b, uint32_t i)
+                           { screen[Map::subidx(hashval)].prefetch(batches[b].hashes[i]); });
+    }
+
+    // Puts a Bloom filter of `bits_per_hash` bits per expected distinct hash in front
+    // of the map, so it only ever holds hashes seen at least twice. Counts are exact
+    // except that a false positive adds one to the hash it hits (and keeps a singleton
+    // it hits, with count 2). Meant for runs that drop singletons anyway.
+    void screen_singletons(size_t expected_distinct, double bits_per_hash)
+    {
+        if (hash_to_count.size() > 0 || !screen.empty())
+        {
+            throw std::logic_error("screen_singletons must be called once, before any hash is added.");
+        }
+        if (!(bits_per_hash > 0))
+        {
+            throw std::invalid_argument("bits_per_hash must be positive.");
+        }
+        const double bits = static_cast<double>(expected_distinct) * bits_per_hash / Map::subcnt();
+        const size_t n_blocks = static_cast<size_t>(std::ceil(bits / (BlockedBloomFilter::block_words * 32)));
+        screen.assign(Map::subcnt(), BlockedBloomFilter(n_blocks));
+        first_sightings.assign(Map::subcnt(), 0);
+        promoted.assign(Map::subcnt(), 0);
+    }
+
+    BloomStats bloom_stats() const
+    {
+        BloomStats stats;
+        for (size_t sub = 0; sub < screen.size(); sub++)
+        {
+            stats.filter_bytes += screen[sub].bytes();
+            stats.first_sightings += first_sightings[sub];
+            stats.promoted += promoted[sub];
+            stats.false_positive_rate += screen[sub].false_positive_rate() / screen.size();
+        }
+        stats.screened = stats.first_sightings - std::min(stats.first_sightings, stats.promoted);
+        stats.slot_bytes_avoided = stats.screened * (sizeof(typename Map::value_type) + 1);
+        return stats;
+    }
+
+    void add_hashes(const HashArray &hashes)
+    {
+        ingest({{hashes.data(), hashes.shape(0)}});
+    }
+
+    void add_many(const vector<HashArray> &hashes)
+    {
+        ingest(to_batches(hashes));
+    }
+
+    IngestStats add_signature_files(const vector<string> &paths, uint32_t ksize, int loaders, size_t queue_size,
+                                    const ProgressCallback &progress)
+    {
+        return load_signature_files(
+            paths, ksize, default_loaders(loaders, threads), queue_size, sketch, [&](const vector<DecodedSignature> &sigs)
+            { ingest(to_batches(sigs)); }, progress);
+    }
+
+    uint32_t ksize() const
+    {
+        return sketch.ksize;
+    }
+
+    uint64_t scale() const
+    {
+        return sketch.scale;
+    }
+
+    // Sizes every submap for `n` distinct hashes up front, so ingest never rehashes.
+    void reserve(size_t n)
+    {
+        hash_to_count.reserve(n);
+    }
+
+    // Count of `hash`, 0 when absent (or kept out by the singleton screen). Takes the
+    // submap's read lock, so with a shared_mutex lookups do not wait for each other.
+    uint32_t query(uint64_t hash) const
+    {
+        uint32_t count = 0;
+        hash_to_count.if_contains(hash, [&](const typename Map::value_type &entry)
+                                  { count = entry.second; });
+        return count;
+    }
+
+    vector<uint32_t> query_many(const HashArray &hashes) const
+    {
+        const uint64_t *data = hashes.data();
+        vector<uint32_t> result(hashes.shape(0));
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (ptrdiff_t i = 0; i < static_cast<ptrdiff_t>(result.size()); i++)
+        {
+            result[i] = query(data[i]);
+        }
+        return result;
+    }
+
+    uint64_t remove_singletons()
+    {
+        return parallel_erase_if(hash_to_count, threads, [](const typename Map::value_type &entry)
+                                 { return entry.second == 1; });
+    }
+
+    uint64_t keep_min_abundance(uint32_t min_abundance)
+    {
+        return parallel_erase_if(hash_to_count, threads, [&](const typename Map::value_type &entry)
+                                 { return entry.second < min_abundance; });
+    }
+
+    // Hashes counted at least `min_abundance` times (and more than once when
+    // `drop_singletons`), with their counts, in increasing hash order if `sorted`.
+    // Filters and copies in one pass without touching the map, so several thresholds
+    // can be exported from one count.
+    CountColumns export_counts(uint32_t min_abundance, bool drop_singletons, bool sorted) const
+    {
+        const uint32_t floor = std::max(min_abundance, drop_singletons ? 2u : 0u);
+        CountColumns columns;
+        export_rows(hash_to_count, threads, [&](const typename Map::value_type &entry)
+                    { return entry.second >= floor; },
+                    field(std::get<0>(columns), entry_key), field(std::get<1>(columns), count_of));
+        if (sorted)
+        {
+            sort_by_hash(threads, columns);
+        }
+        return columns;
+    }
+
+    // Every counted hash, and the counts in the same order while the counter is unchanged.
+    // The two are separate passes over the map, so a hash inserted between them (which
+    // the Concurrent variant allows) misaligns them; export() returns both from one pass.
+    Column<uint64_t> hashes_column() const
+    {
+        Column<uint64_t> hashes;
+        export_rows(hash_to_count, threads, every_entry, field(hashes, entry_key));
+        return hashes;
+    }
+
+    Column<uint32_t> counts_column() const
+    {
+        Column<uint32_t> counts;
+        export_rows(hash_to_count, threads, every_entry, field(counts, count_of));
+        return counts;
+    }
+
+    vector<size_t> submap_sizes() const
+    {
+        return ::submap_sizes(hash_to_count);
+    }
+
+    uint64_t size()
+    {
+        return locked_size(hash_to_count);
+    }
+
+    unordered_map<uint64_t, uint32_t> get_kmers()
+    {
+        unordered_map<uint64_t, uint32_t> result;
+        for_each_entry(hash_to_count, [&](const typename Map::value_type &entry)
+                       { result[entry.first] = entry.second; });
+        return result;
+    }
+};
+
+// Counts hashes without a hash table: incoming hashes are buffered, radix sorted and
+// run-length encoded into sorted (hash, count) runs, and runs are merged as they
+// pile up. Memory grows with the data instead of doubling at resizes, and the
+// result comes out sorted.
+class SortedHashesCounter
+{
+private:
+    // Hashes waiting to be sorted, and the sort's ping-pong buffer.
+    vector<uint64_t> buffer;
+    vector<uint64_t> scratch;
+    size_t buffer_size;
+
+    // Size-tiered runs: levels[i] is how many merge rounds runs[i] went through.
+    // Once `merge_fan_in` runs share the lowest level they are merged one level up,
+    // so every hash is rewritten O(log(n / buffer_size)) times.
+    vector<CountRun> runs;
+    vector<uint32_t> levels;
+    static constexpr size_t merge_fan_in = 8;
+
+    // Runs and the buffer are unsynchronised, so concurrent calls are serialised here.
+    std::mutex mutex;
+
+    int threads;
+    SketchParams sketch;
+
+    void spill_buffer()
+    {
+        if (buffer.empty())
+        {
+            return;
+        }
+        radix_sort(buffer, scratch, threads);
+        runs.push_back(run_length_encode(buffer));
+        levels.push_back(0);
+        buffer.clear();
+
+        while (runs.size() >= merge_fan_in)
+        {
+            const size_t first = runs.size() - merge_fan_in;
+            if (!std::all_of(levels.begin() + first, levels.end(), [&](uint32_t level)
+                             { return level == levels.back(); }))
+            {
+                break;
+            }
+            merge_tail(first, levels.back() + 1);
+        }
+    }
+
+    // Replaces runs[first..] by their merge.
+    void merge_tail(size_t first, uint32_t level)
+    {
+        vector<const CountRun *> inputs;
+        for (size_t r = first; r < runs.size(); r++)
+        {
+            inputs.push_back(&runs[r]);
+        }
+        CountRun merged = merge_runs(inputs, threads);
+        runs.resize(first);
+        levels.resize(first);
+        runs.push_back(std::move(merged));
+        levels.push_back(level);
+    }
+
+    // Leaves every counted hash in runs[0].
+    CountRun &compact()
+    {
+        spill_buffer();
+        if (runs.size() != 1)
+        {
+            merge_tail(0, levels.empty() ? 0 : *std::max_element(levels.begin(), levels.end()));
+        }
+        return runs[0];
+    }
+
+    template <typename Keep>
+    uint64_t filter(Keep &&keep)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        CountRun &run = compact();
+        size_t kept = 0;
+        for (size_t i = 0; i < run.size(); i++)
+        {
+            if (keep(run.counts[i]))
+            {
+                run.hashes[kept] = run.hashes[i];
+                run.counts[kept] = run.counts[i];
+                kept++;
+            }
+        }
+        const uint64_t removed = run.size() - kept;
+        run.hashes.resize(kept);
+        run.counts.resize(kept);
+        return removed;
+    }
+
+public:
+    SortedHashesCounter(int threads = 1, size_t buffer_size = size_t(1) << 24)
+        : buffer_size(std::max<size_t>(buffer_size, 1)), threads(resolve_threads(threads)) {}
+
+    void ingest(const vector<HashBatch> &batches)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const HashBatch &batch : batches)
+        {
+            for (size_t done = 0; done < batch.size;)
+            {
+                const size_t n = std::min(batch.size - done, buffer_size - buffer.size());
+                buffer.insert(buffer.end(), batch.hashes + done, batch.hashes + done + n);
+                done += n;
+                if (buffer.size() == buffer_size)
+                {
+                    spill_buffer();
+                }
+            }
+        }
+    }
+
+    void add_hashes(const HashArray &hashes)
+    {
+        ingest({{hashes.data(), hashes.shape(0)}});
+    }
+
+    void add_many(const vector<HashArray> &hashes)
+    {
+        ingest(to_batches(hashes));
+    }
+
+    IngestStats add_signature_files(const vector<string> &paths, uint32_t ksize, int loaders, size_t queue_size,
+                                    const ProgressCallback &progress)
+    {
+        return load_signature_files(
+            paths, ksize, default_loaders(loaders, threads), queue_size, sketch, [&](const vector<DecodedSignature> &sigs)
+            { ingest(to_batches(sigs)); }, progress);
+    }
+
+    uint32_t ksize() const
+    {
+        return sketch.ksize;
+    }
+
+    uint64_t scale() const
+    {
+        return sketch.scale;
+    }
+
+    // Hashes are buffered at most buffer_size at a time, so only that much is reserved.
+    void reserve(size_t n)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffer.reserve(std::min(n, buffer_size));
+    }
+
+    uint64_t remove_singletons()
+    {
+        return filter([](uint32_t count)
+                      { return count != 1; });
+    }
+
+    uint64_t keep_min_abundance(uint32_t min_abundance)
+    {
+        return filter([&](uint32_t count)
+                      { return count >= min_abundance; });
+    }
+
+    uint64_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return compact().size();
+    }
+
+    unordered_map<uint64_t, uint32_t> get_kmers()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const CountRun &run = compact();
+        unordered_map<uint64_t, uint32_t> result;
+        result.reserve(run.size());
+        for (size_t i = 0; i < run.size(); i++)
+        {
+            result[run.hashes[i]] = run.counts[i];
+        }
+        return result;
+    }
+
+    // Counted hashes in increasing order, aligned with get_counts().
+    vector<uint64_t> get_hashes()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return compact().hashes;
+    }
+
+    vector<uint32_t> get_counts()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return compact().counts;
+    }
+
+    // Hashes counted at least `min_abundance` times (and more than once when
+    // `drop_singletons`), with their counts. The merged run is already in hash
+    // order, so `sorted` costs nothing and this is a filtered copy.
+    CountColumns export_counts(uint32_t min_abundance, bool drop_singletons, bool /* sorted */)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const CountRun &run = compact();
+        const uint32_t floor = std::max(min_abundance, drop_singletons ? 2u : 0u);
+        const size_t kept = std::count_if(run.counts.begin(), run.counts.end(), [&](uint32_t count)
+                                          { return count >= floor; });
+        CountColumns columns;
+        Column<uint64_t> &hashes = std::get<0>(columns);
+        Column<uint32_t> &counts = std::get<1>(columns);
+        hashes.allocate(kept);
+        counts.allocate(kept);
+        size_t row = 0;
+        for (size_t i = 0; i < run.size(); i++)
+        {
+            if (run.counts[i] >= floor)
+            {
+                hashes.data[row] = run.hashes[i];
+                counts.data[row] = run.counts[i];
+                row++;
+            }
+        }
+        return columns;
+    }
+
+    Column<uint64_t> hashes_column()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return column_of(compact().hashes);
+    }
+
+    Column<uint32_t> counts_column()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return column_of(compact().counts);
+    }
+};
+
+// HashesCounter for FracMinHash values of one known scale, storing 8 bytes per slot
+// instead of phmap's 16-byte pair plus control byte. Keys are split by PrefixLayout:
+// the prefix picks one of up to 2^20 small tables and is never stored, and the
+// remaining (at most 40) bits share a word with a 24-bit count that saturates at
+// 16,777,215.
+class CompactHashesCounter
+{
+private:
+    PrefixLayout layout;
+    vector<PackedCountTable> buckets;
+    uint64_t configured_scale;
+
+    // Buckets are unsynchronised, so concurrent calls are serialised here.
+    std::mutex mutex;
+
+    int threads;
+    SketchParams sketch;
+
+    void check_range(const vector<HashBatch> &batches) const
+    {
+        const uint64_t max_key = layout.max_key();
+        for (const HashBatch &batch : batches)
+        {
+            const uint64_t *largest = std::max_element(batch.hashes, batch.hashes + batch.size);
+            if (batch.size > 0 && *largest > max_key)
+            {
+                throw std::invalid_argument("Hash " + std::to_string(*largest) + " is above the max_hash of scale " +
+                                            std::to_string(configured_scale) + ".");
+            }
+        }
+    }
+
+    template <typename Keep>
+    uint64_t filter(Keep &&keep)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t removed = 0;
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 64) reduction(+ : removed)
+        for (ptrdiff_t b = 0; b < static_cast<ptrdiff_t>(buckets.size()); b++)
+        {
+            removed += buckets[b].filter(keep);
+        }
+        return removed;
+    }
+
+public:
+    CompactHashesCounter(uint64_t scale, int threads = 1)
+        : layout(max_hash_for_scale(scale)), configured_scale(scale), threads(resolve_threads(threads))
+    {
+        if (scale == 0)
+        {
+            throw std::invalid_argument("scale must be positive.");
+        }
+        buckets.resize(layout.n_buckets());
+    }
+
+    void ingest(const vector<HashBatch> &batches)
+    {
+        check_range(batches);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (total_batch_size(batches) < min_slice)
+        {
+            for (const HashBatch &batch : batches)
+            {
+                for (size_t i = 0; i < batch.size; i++)
+                {
+                    buckets[layout.bucket(batch.hashes[i])].add(layout.remainder(batch.hashes[i]));
+                }
+            }
+            return;
+        }
+
+        partitioned_apply(
+            batches, buckets.size(), threads, [](uint64_t key)
+            { return static_cast<size_t>(key); },
+            [&](size_t key)
+            { return layout.bucket(key); },
+            [&](size_t b, const RoutedHash *begin, const RoutedHash *end)
+            {
+                PackedCountTable &table = buckets[b];
+                for (const RoutedHash *r = begin; r < end; r++)
+                {
+                    if (static_cast<size_t>(end - r) > prefetch_distance)
+                    {
+                        table.prefetch(layout.remainder(r[prefetch_distance].hashval));
+                    }
+                    table.add(layout.remainder(r->hashval));
+                }
+            });
+    }
+
+    void add_hashes(const HashArray &hashes)
+    {
+        ingest({{hashes.data(), hashes.shape(0)}});
+    }
+
+    void add_many(const vector<HashArray> &hashes)
+    {
+        ingest(to_batches(hashes));
+    }
+
+    IngestStats add_signature_files(const vector<string> &paths, uint32_t ksize, int loaders, size_t queue_size,
+                                    const ProgressCallback &progress)
+    {
+        return load_signature_files(
+            paths, ksize, default_loaders(loaders, threads), queue_size, sketch, [&](const vector<DecodedSignature> &sigs)
+            {
+                for (const DecodedSignature &sig : sigs)
+                {
+                    if (sig.scale() != configured_scale)
+                    {
+                        throw std::invalid_argument("Signature '" + sig.source + "' has scale " + std::to_string(sig.scale()) +
+                                                    ", but this counter was built for scale " +
+                                                    std::to_string(configured_scale) + ".");
+                    }
+                }
+                ingest(to_batches(sigs)); }, progress);
+    }
+
+    uint32_t ksize() const
+    {
+        return sketch.ksize;
+    }
+
+    uint64_t scale() const
+    {
+        return configured_scale;
+    }
+
+    void reserve(size_t n)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const size_t per_bucket = n / buckets.size() + 1;
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (ptrdiff_t b = 0; b < static_cast<ptrdiff_t>(buckets.size()); b++)
+        {
+            buckets[b].reserve(per_bucket);
+        }
+    }
+
+    // Bytes held by the bucket tables.
+    uint64_t table_bytes() const
+    {
+        uint64_t bytes = buckets.size() * sizeof(PackedCountTable);
+        for (const PackedCountTable &table : buckets)
+        {
+            bytes += table.bytes();
+        }
+        return bytes;
+    }
+
+    uint64_t remove_singletons()
+    {
+        return filter([](uint32_t count)
+                      { return count != 1; });
+    }
+
+    uint64_t keep_min_abundance(uint32_t min_abundance)
+    {
+        return filter([&](uint32_t count)
+                      { return count >= min_abundance; });
+    }
+
+    uint64_t size() const
+    {
+        uint64_t total = 0;
+        for (const PackedCountTable &table : buckets)
+        {
+            total += table.size();
+        }
+        return total;
+    }
+
+    unordered_map<uint64_t, uint32_t> get_kmers() const
+    {
+        unordered_map<uint64_t, uint32_t> result;
+        result.reserve(size());
+        for (size_t b = 0; b < buckets.size(); b++)
+        {
+            buckets[b].for_each([&](uint64_t remainder, uint32_t count)
+                                { result[layout.key(b, remainder)] = count; });
+        }
+        return result;
+    }
+
+    // Hashes counted at least `min_abundance` times (and more than once when
+    // `drop_singletons`), with their counts, in increasing hash order if `sorted`.
+    // Buckets follow the key prefix, so sorting only has to sort within each bucket.
+    CountColumns export_counts(uint32_t min_abundance, bool drop_singletons, bool sorted) const
+    {
+        const uint32_t floor = std::max(min_abundance, drop_singletons ? 2u : 0u);
+        CountColumns columns;
+        Column<uint64_t> &hashes = std::get<0>(columns);
+        Column<uint32_t> &counts = std::get<1>(columns);
+        export_parts_if(buckets.size(), threads, [&](size_t b)
+                        { return buckets[b].size(); },
+                        [&](size_t b, size_t first_row)
+                        {
+                size_t row = first_row;
+                buckets[b].for_each([&](uint64_t remainder, uint32_t count)
+                                    {
+                    if (count >= floor)
+                    {
+                        hashes.data[row] = layout.key(b, remainder);
+                        counts.data[row] = count;
+                        row++;
+                    } });
+                if (sorted)
+                {
+                    sort_range_by_hash(first_row, row, hashes, counts);
+                }
+                return row - first_row; },
+                        hashes, counts);
+        return columns;
+    }
+
+    // Every counted hash in bucket order, and the counts in the same order.
+    Column<uint64_t> hashes_column() const
+    {
+        Column<uint64_t> hashes;
+        export_parts(buckets.size(), threads, [&](size_t b)
+                     { return buckets[b].size(); },
+                     [&](size_t b, size_t row)
+                     { buckets[b].for_each([&](uint64_t remainder, uint32_t)
+                                           { hashes.data[row++] = layout.key(b, remainder); }); },
+                     hashes);
+        return hashes;
+    }
+
+    Column<uint32_t> counts_column() const
+    {
+        Column<uint32_t> counts;
+        export_parts(buckets.size(), threads, [&](size_t b)
+                     { return buckets[b].size(); },
+                     [&](size_t b, size_t row)
+                     { buckets[b].for_each([&](uint64_t, uint32_t count)
+                                           { counts.data[row++] = count; }); },
+                     counts);
+        return counts;
+    }
+};
+
+// Plain counter that keeps Count-wide (8- or 16-bit) counts in SmallCountTable
+// partitions and moves only saturated hashes to their partition's overflow map.
+// The low hash bits pick the partition and the bits above them the home slot.
+template <typename Hash, typename Count>
+class BasicSmallHashesCounter
+{
+private:
+    static constexpr int part_bits = 12;
+
+    vector<SmallCountTable<Count>> parts;
+
+    // Partitions are unsynchronised, so concurrent calls are serialised here.
+    std::mutex mutex;
+
+    int threads;
+    SketchParams sketch;
+
+    static size_t part_of(size_t hashval)
+    {
+        return hashval & ((size_t(1) << part_bits) - 1);
+    }
+
+    static size_t slot_of(uint64_t key)
+    {
+        return Hash()(key) >> part_bits;
+    }
+
+    template <typename Keep>
+    uint64_t filter(Keep &&keep)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t removed = 0;
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 64) reduction(+ : removed)
+        for (ptrdiff_t p = 0; p < static_cast<ptrdiff_t>(parts.size()); p++)
+        {
+            removed += parts[p].filter(keep, slot_of);
+        }
+        return removed;
+    }
+
+public:
+    BasicSmallHashesCounter(int threads = 1) : parts(size_t(1) << part_bits), threads(resolve_threads(threads)) {}
+
+    void ingest(const vector<HashBatch> &batches)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (total_batch_size(batches) < min_slice)
+        {
+            for (const HashBatch &batch : batches)
+            {
+                for (size_t i = 0; i < batch.size; i++)
+                {
+                    const size_t hashval = Hash()(batch.hashes[i]);
+                    parts[part_of(hashval)].add(batch.hashes[i], hashval >> part_bits, slot_of);
+                }
+            }
+            return;
+        }
+
+        partitioned_apply(
+            batches, parts.size(), threads, [](uint64_t key)
+            { return Hash()(key); },
+            part_of,
+            [&](size_t p, const RoutedHash *begin, const RoutedHash *end)
+            {
+                SmallCountTable<Count> &table = parts[p];
+                for (const RoutedHash *r = begin; r < end; r++)
+                {
+                    if (static_cast<size_t>(end - r) > prefetch_distance)
+                    {
+                        table.prefetch(r[prefetch_distance].hashval >> part_bits);
+                    }
+                    table.add(batches[r->batch].hashes[r->index], r->hashval >> part_bits, slot_of);
+                }
+            });
+    }
+
+    void add_hashes(const HashArray &hashes)
+    {
+        ingest({{hashes.data(), hashes.shape(0)}});
+    }
+
+    void add_many(const vector<HashArray> &hashes)
+    {
+        ingest(to_batches(hashes));
+    }
+
+    IngestStats add_signature_files(const vector<string> &paths, uint32_t ksize, int loaders, size_t queue_size,
+                                    const ProgressCallback &progress)
+    {
+        return load_signature_files(
+            paths, ksize, default_loaders(loaders, threads), queue_size, sketch, [&](const vector<DecodedSignature> &sigs)
+            { ingest(to_batches(sigs)); }, progress);
+    }
+
+    uint32_t ksize() const
+    {
+        return sketch.ksize;
+    }
+
+    uint64_t scale() const
+    {
+        return sketch.scale;
+    }
+
+    void reserve(size_t n)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const size_t per_part = n / parts.size() + 1;
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (ptrdiff_t p = 0; p < static_cast<ptrdiff_t>(parts.size()); p++)
+        {
+            parts[p].reserve(per_part, slot_of);
+        }
+    }
+
+    // Bytes held by the partition tables and their overflow maps.
+    uint64_t table_bytes() const
+    {
+        uint64_t bytes = parts.size() * sizeof(SmallCountTable<Count>);
+        for (const SmallCountTable<Count> &table : parts)
+        {
+            bytes += table.bytes();
+        }
+        return bytes;
+    }
+
+    // Hashes whose count no longer fits in Count.
+    uint64_t overflow_size() const
+    {
+        uint64_t total = 0;
+        for (const SmallCountTable<Count> &table : parts)
+        {
+            total += table.overflow_size();
+        }
+        return total;
+    }
+
+    uint64_t remove_singletons()
+    {
+        return filter([](uint32_t count)
+                      { return count != 1; });
+    }
+
+    uint64_t keep_min_abundance(uint32_t min_abundance)
+    {
+        return filter([&](uint32_t count)
+                      { return count >= min_abundance; });
+    }
+
+    uint64_t size() const
+    {
+        uint64_t total = 0;
+        for (const SmallCountTable<Count> &table : parts)
+        {
+            total += table.size();
+        }
+        return total;
+    }
+
+    unordered_map<uint64_t, uint32_t> get_kmers() const
+    {
+        unordered_map<uint64_t, uint32_t> result;
+        result.reserve(size());
+        for (const SmallCountTable<Count> &table : parts)
+        {
+            table.for_each([&](uint64_t key, uint32_t count)
+                           { result[key] = count; });
+        }
+        return result;
+    }
+
+    // Hashes counted at least `min_abundance` times (and more than once when
+    // `drop_singletons`), with their counts, in increasing hash order if `sorted`.
+    // Partitions come from the low hash bits, so sorting reorders all rows.
+    CountColumns export_counts(uint32_t min_abundance, bool drop_singletons, bool sorted) const
+    {
+        const uint32_t floor = std::max(min_abundance, drop_singletons ? 2u : 0u);
+        CountColumns columns;
+        Column<uint64_t> &hashes = std::get<0>(columns);
+        Column<uint32_t> &counts = std::get<1>(columns);
+        export_parts_if(parts.size(), threads, [&](size_t p)
+                        { return parts[p].size(); },
+                        [&](size_t p, size_t first_row)
+                        {
+                size_t row = first_row;
+                parts[p].for_each([&](uint64_t key, uint32_t count)
+                                  {
+                    if (count >= floor)
+                    {
+                        hashes.data[row] = key;
+                        counts.data[row] = count;
+                        row++;
+                    } });
+                return row - first_row; },
+                        hashes, counts);
+        if (sorted)
+        {
+            sort_by_hash(threads, columns);
+        }
+        return columns;
+    }
+
+    // Every counted hash in partition order, and the counts in the same order.
+    Column<uint64_t> hashes_column() const
+    {
+        Column<uint64_t> hashes;
+        export_parts(parts.size(), threads, [&](size_t p)
+                     { return parts[p].size(); },
+                     [&](size_t p, size_t row)
+                     { parts[p].for_each([&](uint64_t key, uint32_t)
+                                         { hashes.data[row++] = key; }); },
+                     hashes);
+        return hashes;
+    }
+
+    Column<uint32_t> counts_column() const
+    {
+        Column<uint32_t> counts;
+        export_parts(parts.size(), threads, [&](size_t p)
+                     { return parts[p].size(); },
+                     [&](size_t p, size_t row)
+                     { parts[p].for_each([&](uint64_t, uint32_t count)
+                                         { counts.data[row++] = count; }); },
+                     counts);
+        return counts;
+    }
+};
+
+// Plain counter with a memory budget. Hashes are counted in a map sized to the
+// budget; whenever it fills, its (hash, count) pairs are appended to per-partition
+// spill files and the map is reused. Filters and export then merge one partition at
+// a time per worker, so peak memory follows the budget and the partition size
+// rather than the number of distinct hashes. Until the first spill this behaves
+// exactly like HashesCounter.
+template <typename Hash>
+class BasicSpillingHashesCounter
+{
+private:
+    using Map = CounterMap<uint32_t, Hash>;
+
+    Map hash_to_count;
+    size_t spill_at;
+
+    // Each submap owns 2^fan_bits partitions, so submaps spill independently.
+    int fan_bits;
+    string temp_dir;
+    std::unique_ptr<SpillFiles> files;
+    uint64_t spills = 0;
+
+    // Set by compact() and cleared by spill(): every partition holds one record per
+    // hash, so unless more hashes arrived since, reading the partitions back needs no
+    // merge and keeps their order.
+    bool merged = false;
+
+    // Spill files are unsynchronised, so concurrent calls are serialised here.
+    std::mutex mutex;
+
+    int threads;
+    SketchParams sketch;
+
+    size_t part_of(uint64_t key) const
+    {
+        const size_t hashval = Hash()(key);
+        const size_t fan = fan_bits == 0 ? 0 : (hashval * 0x9e3779b97f4a7c15ULL) >> (64 - fan_bits);
+        return (Map::subidx(hashval) << fan_bits) | fan;
+    }
+
+    void ingest_slice(const vector<HashBatch> &batches)
+    {
+        partitioned_ingest(hash_to_count, batches, threads,
+                           [&](auto &set, size_t hashval, uint32_t b, uint32_t i)
+                           { submap_value(set, batches[b].hashes[i], hashval)++; });
+    }
+
+    // Moves the map's contents to the spill files, keeping its capacity for reuse.
+    void spill()
+    {
+        if (!files)
+        {
+            files = std::make_unique<SpillFiles>(Map::subcnt() << fan_bits, temp_dir);
+        }
+        parallel_for_each_index(Map::subcnt(), threads, [&](size_t sub)
+                                {
+            hash_to_count.with_submap_m(sub, [&](auto &set)
+                                        {
+                for (const auto &entry : set)
+                {
+                    files->append(part_of(entry.first), entry.first, entry.second);
+                }
+                set.clear(); });
+            for (size_t part = sub << fan_bits; part < (sub + 1) << fan_bits; part++)
+            {
+                files->flush(part);
+            } });
+        spills++;
+        merged = false;
+    }
+
+    // Merges every partition's records into one per hash, dropping those whose
+    // count fails `keep`, and returns how many were dropped.
+    template <typename Keep>
+    uint64_t compact(Keep &&keep)
+    {
+        if (hash_to_count.size() > 0)
+        {
+            spill();
+        }
+        vector<uint64_t> removed(files->size(), 0);
+        parallel_for_each_index(files->size(), threads, [&](size_t part)
+                                {
+            vector<SpillRecord> records = files->read(part);
+            phmap::flat_hash_map<uint64_t, uint32_t, MixedHash> counts;
+            counts.reserve(records.size());
+            for (const SpillRecord &record : records)
+            {
+                uint32_t &count = counts[record.key];
+                count = static_cast<uint32_t>(std::min<uint64_t>(uint64_t(count) + record.count, std::numeric_limits<uint32_t>::max()));
+            }
+            records.clear();
+            for (const auto &entry : counts)
+            {
+                if (keep(entry.second))
+                {
+                    records.push_back({entry.first, entry.second});
+                }
+                else
+                {
+                    removed[part]++;
+                }
+            }
+            files->rewrite(part, records); });
+        merged = true;
+
+        uint64_t total = 0;
+        for (uint64_t n : removed)
+        {
+            total += n;
+        }
+        return total;
+    }
+
+    // compact() keeping every hash, skipped when the partitions already hold one
+    // record per hash and nothing was counted since.
+    void merge_spills()
+    {
+        if (!merged || hash_to_count.size() > 0)
+        {
+            compact([](uint32_t)
+                    { return true; });
+        }
+    }
+
+    template <typename Keep>
+    uint64_t filter(Keep &&keep)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (files)
+        {
+            return compact(keep);
+        }
+        return parallel_erase_if(hash_to_count, threads, [&](const typename Map::value_type &entry)
+                                 { return !keep(entry.second); });
+    }
+
+public:
+    BasicSpillingHashesCounter(size_t memory_bytes, int threads = 1, const string &temp_dir = "",
+                               size_t partitions = 1024)
+        : temp_dir(temp_dir), threads(resolve_threads(threads))
+    {
+        if (partitions < Map::subcnt() || (partitions & (partitions - 1)) != 0)
+        {
+            throw std::invalid_argument("partitions must be a power of two of at least " +
+                                        std::to_string(Map::subcnt()) + ".");
+        }
+        fan_bits = __builtin_ctzll(partitions / Map::subcnt());
+
+        // Submap capacities are powers of two, so size each one to the largest that
+        // fits its share of the budget, and spill a little below phmap's 7/8 load
+        // limit to absorb uneven submaps without a rehash.
+        const size_t slot_bytes = sizeof(typename Map::value_type) + 1;
+        size_t slots = 1024;
+        while (slots * 2 * slot_bytes * Map::subcnt() <= memory_bytes)
+        {
+            slots *= 2;
+        }
+        const size_t per_submap = slots * 7 / 8;
+        hash_to_count.reserve(per_submap * Map::subcnt());
+        spill_at = per_submap * Map::subcnt() * 9 / 10;
+    }
+
+    void ingest(const vector<HashBatch> &batches)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // A slice of n hashes adds at most n entries, so slices sized to the room left
+        // keep the map below spill_at. Spilling early when little room is left keeps
+        // slices large.
+        vector<HashBatch> slice;
+        size_t b = 0;
+        size_t offset = 0;
+        while (b < batches.size())
+        {
+            if (hash_to_count.size() + spill_at / 16 > spill_at)
+            {
+                spill();
+            }
+            size_t room = spill_at - hash_to_count.size();
+            slice.clear();
+            while (room > 0 && b < batches.size())
+            {
+                const size_t take = std::min(room, batches[b].size - offset);
+                slice.push_back({batches[b].hashes + offset, take});
+                room -= take;
+                offset += take;
+                if (offset == batches[b].size)
+                {
+                    b++;
+                    offset = 0;
+                }
+            }
+            ingest_slice(slice);
+        }
+    }
+
+    void add_hashes(const HashArray &hashes)
+    {
+        ingest({{hashes.data(), hashes.shape(0)}});
+    }
+
+    void add_many(const vector<HashArray> &hashes)
+    {
+        ingest(to_batches(hashes));
+    }
+
+    IngestStats add_signature_files(const vector<string> &paths, uint32_t ksize, int loaders, size_t queue_size,
+                                    const ProgressCallback &progress)
+    {
+        return load_signature_files(
+            paths, ksize, default_loaders(loaders, threads), queue_size, sketch, [&](const vector<DecodedSignature> &sigs)
+            { ingest(to_batches(sigs)); }, progress);
+    }
+
+    uint32_t ksize() const
+    {
+        return sketch.ksize;
+    }
+
+    uint64_t scale() const
+    {
+        return sketch.scale;
+    }
+
+    // Times the map was written out, and the bytes its spill files hold now.
+    uint64_t spill_count() const
+    {
+        return spills;
+    }
+
+    uint64_t spilled_bytes() const
+    {
+        return files ? files->bytes_on_disk() : 0;
+    }
+
+    uint64_t remove_singletons()
+    {
+        return filter([](uint32_t count)
+                      { return count != 1; });
+    }
+
+    uint64_t keep_min_abundance(uint32_t min_abundance)
+    {
+        return filter([&](uint32_t count)
+                      { return count >= min_abundance; });
+    }
+
+    uint64_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!files)
+        {
+            return hash_to_count.size();
+        }
+        merge_spills();
+        uint64_t total = 0;
+        for (size_t part = 0; part < files->size(); part++)
+        {
+            total += files->records(part);
+        }
+        return total;
+    }
+
+    unordered_map<uint64_t, uint32_t> get_kmers()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        unordered_map<uint64_t, uint32_t> result;
+        if (!files)
+        {
+            for (auto it = hash_to_count.begin(); it != hash_to_count.end(); ++it)
+            {
+                result[it->first] = it->second;
+            }
+            return result;
+        }
+        merge_spills();
+        for (size_t part = 0; part < files->size(); part++)
+        {
+            for (const SpillRecord &record : files->read(part))
+            {
+                result[record.key] = record.count;
+            }
+        }
+        return result;
+    }
+
+    // Hashes counted at least `min_abundance` times (and more than once when
+    // `drop_singletons`), with their counts, in increasing hash order if `sorted`.
+    // Once spilled, the partitions are merged (if not already) and read back in
+    // parallel, filtering as they are read; both columns come from that one read.
+    // Partitions come from the hash's submap and mixed bits, so sorting reorders all rows.
+    CountColumns export_counts(uint32_t min_abundance, bool drop_singletons, bool sorted)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const uint32_t floor = std::max(min_abundance, drop_singletons ? 2u : 0u);
+        CountColumns columns;
+        Column<uint64_t> &hashes = std::get<0>(columns);
+        Column<uint32_t> &counts = std::get<1>(columns);
+        if (!files)
+        {
+            export_rows(hash_to_count, threads, [&](const typename Map::value_type &entry)
+                        { return entry.second >= floor; },
+                        field(hashes, entry_key),
+                        field(counts, [](const typename Map::value_type &entry)
+                              { return entry.second; }));
+        }
+        else
+        {
+            merge_spills();
+            export_parts_if(files->size(), threads, [&](size_t part)
+                            { return files->records(part); },
+                            [&](size_t part, size_t first_row)
+                            {
+                size_t row = first_row;
+                for (const SpillRecord &record : files->read(part))
+                {
+                    if (record.count >= floor)
+                    {
+                        hashes.data[row] = record.key;
+                        counts.data[row] = record.count;
+                        row++;
+                    }
+                }
+                return row - first_row; },
+                            hashes, counts);
+        }
+        if (sorted)
+        {
+            sort_by_hash(threads, columns);
+        }
+        return columns;
+    }
+
+    // Every counted hash with its count, from one read of the spill files.
+    CountColumns count_columns()
+    {
+        return export_counts(0, false, false);
+    }
+
+    // Each reads every partition back and keeps one column; count_columns() (bound as
+    // get_columns) gets both from one read.
+    Column<uint64_t> hashes_column()
+    {
+        return std::move(std::get<0>(count_columns()));
+    }
+
+    Column<uint32_t> counts_column()
+    {
+        return std::move(std::get<1>(count_columns()));
+    }
+};
+
+// Approximate counter in a fixed memory budget, backed by a BlockedCountMinSketch.
+// A count-min sketch cannot list its keys, so hashes whose estimate reaches
+// `heavy_threshold` on one of their own insertions are remembered per sketch
+// partition. Estimates never fall below true counts (up to the sketch's 65535 cap),
+// so every hash truly seen that many times is among them; heavy_hitters() reports
+// them with current estimates.
+class ApproxHashesCounter
 {
 private:
-    phmap::parallel_flat_hash_map<
-        uint64_t, uint32_t,
-        std::hash<uint64_t>,
-        std::equal_to<uint64_t>,
-        std::allocator<std::pair<uint64_t, uint32_t>>,
-        6,
-        std::mutex>
-        hash_to_count;
+    BlockedCountMinSketch cms;
+    uint32_t heavy_threshold;
+    vector<phmap::flat_hash_set<uint64_t, MixedHash>> candidates;
+    vector<uint64_t> counted;
+
+    // Partitions are unsynchronised, so concurrent calls are serialised here.
+    std::mutex mutex;
+
+    int threads;
+    SketchParams sketch;
+
+    void count(size_t part, uint64_t key, uint64_t h)
+    {
+        counted[part]++;
+        if (cms.add(h) >= heavy_threshold && heavy_threshold > 0)
+        {
+            candidates[part].insert(key);
+        }
+    }
+
+public:
+    ApproxHashesCounter(size_t memory_bytes, int threads = 1, uint32_t heavy_threshold = 2)
+        : cms(memory_bytes), heavy_threshold(heavy_threshold), candidates(BlockedCountMinSketch::n_parts()),
+          counted(BlockedCountMinSketch::n_parts(), 0), threads(resolve_threads(threads))
+    {
+    }
+
+    void ingest(const vector<HashBatch> &batches)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (total_batch_size(batches) < min_slice)
+        {
+            for (const HashBatch &batch : batches)
+            {
+                for (size_t i = 0; i < batch.size; i++)
+                {
+                    const uint64_t h = BlockedCountMinSketch::remix(batch.hashes[i]);
+                    count(BlockedCountMinSketch::part(h), batch.hashes[i], h);
+                }
+            }
+            return;
+        }
+
+        partitioned_apply(
+            batches, BlockedCountMinSketch::n_parts(), threads, BlockedCountMinSketch::remix,
+            BlockedCountMinSketch::part,
+            [&](size_t p, const RoutedHash *begin, const RoutedHash *end)
+            {
+                for (const RoutedHash *r = begin; r < end; r++)
+                {
+                    if (static_cast<size_t>(end - r) > prefetch_distance)
+                    {
+                        cms.prefetch(r[prefetch_distance].hashval);
+                    }
+                    count(p, batches[r->batch].hashes[r->index], r->hashval);
+                }
+            });
+    }
+
+    void add_hashes(const HashArray &hashes)
+    {
+        ingest({{hashes.data(), hashes.shape(0)}});
+    }
+
+    void add_many(const vector<HashArray> &hashes)
+    {
+        ingest(to_batches(hashes));
+    }
+
+    IngestStats add_signature_files(const vector<string> &paths, uint32_t ksize, int loaders, size_t queue_size,
+                                    const ProgressCallback &progress)
+    {
+        return load_signature_files(
+            paths, ksize, default_loaders(loaders, threads), queue_size, sketch, [&](const vector<DecodedSignature> &sigs)
+            { ingest(to_batches(sigs)); }, progress);
+    }
+
+    uint32_t ksize() const
+    {
+        return sketch.ksize;
+    }
+
+    uint64_t scale() const
+    {
+        return sketch.scale;
+    }
+
+    // Estimated count of `hash`: never below the true count, capped at 65535.
+    uint32_t query(uint64_t hash) const
+    {
+        return cms.estimate(BlockedCountMinSketch::remix(hash));
+    }
+
+    vector<uint32_t> query_many(const HashArray &hashes) const
+    {
+        const uint64_t *data = hashes.data();
+        vector<uint32_t> result(hashes.shape(0));
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (ptrdiff_t i = 0; i < static_cast<ptrdiff_t>(result.size()); i++)
+        {
+            result[i] = cms.estimate(BlockedCountMinSketch::remix(data[i]));
+        }
+        return result;
+    }
+
+    // Hashes estimated at `min_count` or more (0 means the heavy threshold).
+    unordered_map<uint64_t, uint32_t> heavy_hitters(uint32_t min_count)
+    {
+        if (heavy_threshold == 0)
+        {
+            throw std::logic_error("This counter was built with heavy_threshold=0 and tracks no heavy hitters.");
+        }
+        if (min_count == 0)
+        {
+            min_count = heavy_threshold;
+        }
+        if (min_count < heavy_threshold)
+        {
+            throw std::invalid_argument("min_count " + std::to_string(min_count) + " is below the heavy threshold " +
+                                        std::to_string(heavy_threshold) + " this counter was built with.");
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        unordered_map<uint64_t, uint32_t> result;
+        for (const phmap::flat_hash_set<uint64_t, MixedHash> &part : candidates)
+        {
+            for (uint64_t key : part)
+            {
+                const uint32_t estimate = cms.estimate(BlockedCountMinSketch::remix(key));
+                if (estimate >= min_count)
+                {
+                    result[key] = estimate;
+                }
+            }
+        }
+        return result;
+    }
+
+    // Hashes counted so far, repeats included.
+    uint64_t total() const
+    {
+        uint64_t total = 0;
+        for (uint64_t n : counted)
+        {
+            total += n;
+        }
+        return total;
+    }
+
+    // Bytes held by the sketch (the heavy-hitter candidates come on top).
+    uint64_t sketch_bytes() const
+    {
+        return cms.bytes();
+    }
+
+    uint64_t candidate_count() const
+    {
+        uint64_t total = 0;
+        for (const phmap::flat_hash_set<uint64_t, MixedHash> &part : candidates)
+        {
+            total += part.size();
+        }
+        return total;
+    }
+};
+
+// Value of the weighted counter's map: the accumulated score while hashes are
+// added, overwritten in place by the rounded count when the scores are finalised.
+template <typename Score>
+union ScoreOrCount
+{
+    Score score = Score();
+    uint32_t count;
+};
+
+// Quantises every per-sample score to a fixed-point Score up front, in plain loops
+// over each batch, so the map update is an integer add. Negative abundances have
+// no fixed-point encoding and are rejected before anything is inserted.
+template <typename Score, typename T>
+static vector<vector<Score>> encode_scores(const vector<HashBatch> &batches, const vector<AbundanceBatch<T>> &abundances,
+                                           const ScoreFormat<Score> &format, double cap, int threads)
+{
+    vector<vector<Score>> scores(batches.size());
+    bool negative = false;
+#pragma omp parallel for num_threads(threads) schedule(dynamic) reduction(|| : negative)
+    for (ptrdiff_t b = 0; b < static_cast<ptrdiff_t>(batches.size()); b++)
+    {
+        scores[b].resize(batches[b].size);
+        const T *in = abundances[b].abundances;
+        const float inv_mean_abundance = abundances[b].inv_mean_abundance;
+        Score *out = scores[b].data();
+        size_t negatives = 0;
+        for (size_t i = 0; i < batches[b].size; i++)
+        {
+            const double score = in[i] * inv_mean_abundance;
+            negatives += score < 0;
+            out[i] = format.encode(std::min(std::max(score, 0.0), cap));
+        }
+        negative = negative || negatives > 0;
+    }
+    if (negative)
+    {
+        throw std::invalid_argument("Abundances cannot be negative with fixed-point scores.");
+    }
+    return scores;
+}
+
+// Score is float, or uint32_t/uint64_t for fixed-point scores (see ScoreFormat).
+template <typename Hash, typename Score = float, typename Mutex = std::mutex>
+class BasicWeightedHashesCounter
+{
+protected:
+    using Map = CounterMap<ScoreOrCount<Score>, Hash, std::allocator, Mutex>;
+
+    // One map for both phases, so finalising needs no second table.
+    Map hash_to_score;
+
+    // Set by round_scores(): values are counts from then on.
+    bool finalized = false;
+
+    int threads;
+
+    // Per-sample scores are capped at 2 unless this is the uncapped variant.
+    bool capped;
+
+    ScoreFormat<Score> format;
+
+    SketchParams sketch;
+
+    static uint32_t count_of(const typename Map::value_type &entry)
+    {
+        return entry.second.count;
+    }
 
 public:
-    HashesCounter() {}
+    explicit BasicWeightedHashesCounter(int threads = 1, bool capped = true,
+                                        int fraction_bits = ScoreFormat<Score>::default_fraction_bits())
+        : threads(resolve_threads(threads)), capped(capped), format(fraction_bits) {}
+
+    template <typename T>
+    void ingest(const vector<HashBatch> &batches, const vector<AbundanceBatch<T>> &abundances)
+    {
+        if (finalized)
+        {
+            throw std::logic_error("Scores were already rounded; add every hash before calling round_scores().");
+        }
+        if constexpr (ScoreFormat<Score>::fixed_point)
+        {
+            const vector<vector<Score>> scores =
+                encode_scores(batches, abundances, format, capped ? 2.0 : HUGE_VAL, threads);
+            partitioned_ingest(hash_to_score, batches, threads,
+                               [&](auto &set, size_t hashval, uint32_t b, uint32_t i)
+                               {
+                                   Score &score = submap_value(set, batches[b].hashes[i], hashval).score;
+                                   score = format.add(score, scores[b][i]);
+                               });
+        }
+        else if (capped)
+        {
+            partitioned_ingest(hash_to_score, batches, threads,
+                               [&](auto &set, size_t hashval, uint32_t b, uint32_t i)
+                               {
+                                   double score = abundances[b].abundances[i] * abundances[b].inv_mean_abundance;
+                                   if (score >= 2)
+                                       submap_value(set, batches[b].hashes[i], hashval).score += 2;
+                                   else
+                                       submap_value(set, batches[b].hashes[i], hashval).score += score;
+                               });
+        }
+        else
+        {
+            partitioned_ingest(hash_to_score, batches, threads,
+                               [&](auto &set, size_t hashval, uint32_t b, uint32_t i)
+                               { submap_value(set, batches[b].hashes[i], hashval).score += abundances[b].abundances[i] * abundances[b].inv_mean_abundance; });
+        }
+    }
+
+    template <typename T>
+    void add_hashes(const HashArray &hashes, const AbundanceArray<T> &abundances, float mean_abundance)
+    {
+        check_same_size(hashes, abundances);
+        ingest<T>({{hashes.data(), hashes.shape(0)}}, {{abundances.data(), 1.0f / mean_abundance}});
+    }
+
+    template <typename T>
+    void add_many(const vector<HashArray> &hashes, const vector<AbundanceArray<T>> &abundances,
+                  const vector<float> &mean_abundances)
+    {
+        vector<AbundanceBatch<T>> abundance_batches = to_abundance_batches(hashes, abundances, mean_abundances);
+        ingest(to_batches(hashes), abundance_batches);
+    }
+
+    IngestStats add_signature_files(const vector<string> &paths, uint32_t ksize, int loaders, size_t queue_size,
+                                    const ProgressCallback &progress)
+    {
+        return load_signature_files(
+            paths, ksize, default_loaders(loaders, threads), queue_size, sketch, [&](const vector<DecodedSignature> &sigs)
+            { ingest(to_batches(sigs), to_abundance_batches(sigs)); }, progress);
+    }
+
+    uint32_t ksize() const
+    {
+        return sketch.ksize;
+    }
+
+    uint64_t scale() const
+    {
+        return sketch.scale;
+    }
+
+    // Sizes the map for `n` distinct hashes up front, so ingest never rehashes.
+    void reserve(size_t n)
+    {
+        hash_to_score.reserve(n);
+    }
+
+    int fraction_bits() const
+    {
+        return format.bits();
+    }
+
+    // Adds the scores of a counter filled separately (another batch of files, say),
+    // one submap per worker. Both must be configured alike and not rounded yet. With
+    // fixed-point scores the result is exactly that of one counter fed both inputs.
+    void merge(const BasicWeightedHashesCounter &other)
+    {
+        if (&other == this)
+        {
+            throw std::invalid_argument("A counter cannot be merged into itself.");
+        }
+        if (finalized || other.finalized)
+        {
+            throw std::logic_error("Counters must be merged before round_scores().");
+        }
+        if (other.capped != capped || other.format.bits() != format.bits())
+        {
+            throw std::invalid_argument("Only counters with the same capping and fraction_bits can be merged.");
+        }
+        sketch.merge(other.sketch);
+        parallel_for_each_index(Map::subcnt(), threads, [&](size_t sub)
+                                { other.hash_to_score.with_submap(sub, [&](const auto &from)
+                                                                  { hash_to_score.with_submap_m(sub, [&](auto &to)
+                                                                                                {
+                for (const auto &entry : from)
+                {
+                    Score &score = submap_value(to, entry.first, hash_to_score.hash(entry.first)).score;
+                    score = format.add(score, entry.second.score);
+                } }); }); });
+    }
+
+    // Score of `hash` (its count once the scores are rounded), 0 when absent.
+    double query(uint64_t hash) const
+    {
+        double value = 0;
+        hash_to_score.if_contains(hash, [&](const typename Map::value_type &entry)
+                                  { value = finalized ? entry.second.count : format.decode(entry.second.score); });
+        return value;
+    }
+
+    vector<double> query_many(const HashArray &hashes) const
+    {
+        const uint64_t *data = hashes.data();
+        vector<double> result(hashes.shape(0));
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (ptrdiff_t i = 0; i < static_cast<ptrdiff_t>(result.size()); i++)
+        {
+            result[i] = query(data[i]);
+        }
+        return result;
+    }
+
+    // Truncates every score to a count in place, dropping those below 2, one submap
+    // per worker. Counts (get_kmers, size, keep_min_abundance) exist only afterwards.
+    uint64_t round_scores()
+    {
+        if (finalized)
+        {
+            return 0;
+        }
+        const uint64_t skipped_hashes_after_rounding = parallel_erase_if(
+            hash_to_score, threads, [&](typename Map::value_type &entry)
+            {
+                const uint32_t rounded_score = format.truncate(entry.second.score);
+                entry.second.count = rounded_score;
+                return rounded_score <= 1; });
+        finalized = true;
+        return skipped_hashes_after_rounding;
+    }
 
-    void add_hashes(const vector<uint64_t> &hashes)
+    unordered_map<uint64_t, uint32_t> get_kmers()
     {
-        for (uint64_t hash_val : hashes)
+        unordered_map<uint64_t, uint32_t> result;
+        if (!finalized)
         {
-            hash_to_count[hash_val]++;
+            return result;
         }
+        for_each_entry(hash_to_score, [&](const typename Map::value_type &entry)
+                       { result[entry.first] = entry.second.count; });
+        return result;
     }
 
-    uint64_t remove_singletons()
+    vector<size_t> submap_sizes() const
     {
-        uint64_t singletons_counter = 0;
-        for (auto it = hash_to_count.begin(); it != hash_to_count.end();)
+        return ::submap_sizes(hash_to_score);
+    }
+
+    uint64_t size()
+    {
+        return finalized ? locked_size(hash_to_score) : 0;
+    }
+
+    uint64_t keep_min_abundance(uint32_t min_abundance)
+    {
+        if (!finalized)
         {
-            if (it->second == 1)
-            {
-                it = hash_to_count.erase(it);
-                ++singletons_counter;
-            }
-            else
-            {
-                ++it;
-            }
+            return 0;
         }
-        return singletons_counter;
+        return parallel_erase_if(hash_to_score, threads, [&](const typename Map::value_type &entry)
+                                 { return entry.second.count < min_abundance; });
     }
 
-    void keep_min_abundance(uint32_t min_abundance)
+    // Rounded counts of at least `min_abundance`, as HashesCounter::export_counts.
+    // Rounding already dropped counts below 2, so `drop_singletons` changes nothing;
+    // before round_scores() there is nothing to export.
+    CountColumns export_counts(uint32_t min_abundance, bool drop_singletons, bool sorted) const
     {
-        for (auto it = hash_to_count.begin(); it != hash_to_count.end();)
+        (void)drop_singletons;
+        CountColumns columns;
+        export_rows(hash_to_score, threads, [&](const typename Map::value_type &entry)
+                    { return finalized && entry.second.count >= min_abundance; },
+                    field(std::get<0>(columns), entry_key), field(std::get<1>(columns), count_of));
+        if (sorted)
         {
-            if (it->second < min_abundance)
-            {
-                it = hash_to_count.erase(it);
-            }
-            else
-            {
-                ++it;
-            }
+            sort_by_hash(threads, columns);
         }
+        return columns;
     }
 
-    uint64_t size()
+    // Rounded hashes and counts, as HashesCounter's (including the caveat on inserts
+    // between the two calls); empty before round_scores().
+    Column<uint64_t> hashes_column() const
     {
-        return hash_to_count.size();
+        Column<uint64_t> hashes;
+        export_rows(hash_to_score, threads, [&](const typename Map::value_type &)
+                    { return finalized; }, field(hashes, entry_key));
+        return hashes;
     }
 
-    unordered_map<uint64_t, uint32_t> get_kmers()
+    Column<uint32_t> counts_column() const
     {
-        unordered_map<uint64_t, uint32_t> result;
-        for (auto it = hash_to_count.begin(); it != hash_to_count.end(); ++it)
-        {
-            result[it->first] = it->second;
-        }
-        return result;
+        Column<uint32_t> counts;
+        export_rows(hash_to_score, threads, [&](const typename Map::value_type &)
+                    { return finalized; }, field(counts, count_of));
+        return counts;
     }
 };
 
-class WeightedHashesCounter
+template <typename Hash>
+class BasicWeightedHashesCounterUncapped : public BasicWeightedHashesCounter<Hash>
 {
-protected:
-    phmap::parallel_flat_hash_map<uint64_t, uint32_t, std::hash<uint64_t>,
-                                  std::equal_to<uint64_t>, std::allocator<std::pair<uint64_t, uint32_t>>,
-                                  6, std::mutex>
-        hash_to_count;
+public:
+    BasicWeightedHashesCounterUncapped(int threads = 1) : BasicWeightedHashesCounter<Hash>(threads, false) {}
+
+    void merge(const BasicWeightedHashesCounterUncapped &other)
+    {
+        BasicWeightedHashesCounter<Hash>::merge(other);
+    }
+};
 
-    phmap::parallel_flat_hash_map<uint64_t, float, std::hash<uint64_t>, std::equal_to<uint64_t>, std::allocator<std::pair<uint64_t, float>>,
-                                  6, std::mutex>
-        hash_to_score;
+// Dosage is float, or uint32_t/uint64_t for fixed-point dosages (see ScoreFormat).
+template <typename Hash, typename Dosage = float, typename Mutex = std::mutex>
+class BasicSamplesKmerDosageHybridCounter
+{
 
 public:
-    WeightedHashesCounter() {}
+    using Map = CounterMap<std::tuple<uint32_t, Dosage>, Hash, std::allocator, Mutex>;
+
+    // Updated to store kmer_dosage as float internally
+    Map hash_to_count;
+
+    int threads;
+    ScoreFormat<Dosage> format;
+    SketchParams sketch;
+
+    // Set by round_scores(). Dosages are then reported as percentages: the x100 is
+    // applied on the way out, in 64 bits, so the accumulator only has to hold the sum.
+    bool rounded = false;
 
-    void add_hashes(const vector<uint64_t> &hashes, const vector<float> &abundances, float mean_abundance)
+    uint32_t rounded_dosage(Dosage dosage) const
     {
-        const float inv_mean_abundance = 1.0f / mean_abundance; // Precompute reciprocal for faster division
-        const size_t n = hashes.size();                         // Cache the size for efficiency
+        return rounded ? static_cast<uint32_t>(format.round_product(dosage, 100)) : format.round(dosage);
+    }
 
-        for (size_t i = 0; i < n; i++)
+    // Throws if a dosage saturated its Score while accumulating, or if it would not
+    // fit the uint32 it is exported as once scaled, rather than clamping it silently.
+    void check_dosages() const
+    {
+        std::atomic<bool> overflow(false);
+        parallel_for_each_index(Map::subcnt(), threads, [&](size_t sub)
+                                { hash_to_count.with_submap(sub, [&](const auto &set)
+                                                            {
+                for (const auto &entry : set)
+                {
+                    const Dosage dosage = std::get<1>(entry.second);
+                    if ((ScoreFormat<Dosage>::fixed_point && dosage == ScoreFormat<Dosage>::max_score) ||
+                        format.round_product(dosage, 100) > std::numeric_limits<uint32_t>::max())
+                    {
+                        overflow = true;
+                        return;
+                    }
+                } }); });
+        if (overflow)
         {
-            double score = abundances[i] * inv_mean_abundance;
-            if (score >= 2)
-                hash_to_score[hashes[i]] += 2;
-            else
-                hash_to_score[hashes[i]] += score;
+            throw std::overflow_error("A k-mer dosage is too large for this counter's score type; use "
+                                      "FixedSamplesKmerDosageHybridCounter64 or fewer fraction_bits.");
         }
     }
 
-    uint64_t round_scores()
+    explicit BasicSamplesKmerDosageHybridCounter(int threads = 1,
+                                                 int fraction_bits = ScoreFormat<Dosage>::default_fraction_bits())
+        : threads(resolve_threads(threads)), format(fraction_bits) {}
+
+    template <typename T>
+    void ingest(const vector<HashBatch> &batches, const vector<AbundanceBatch<T>> &abundances)
     {
-        uint64_t skipped_hashes_after_rounding = 0;
-        for (auto it = hash_to_score.begin(); it != hash_to_score.end(); ++it)
+        // Validate up front: nothing may throw once the parallel insert has started.
+        for (size_t b = 0; b < batches.size(); b++)
         {
-            uint32_t rounded_score = static_cast<uint32_t>(it->second);
-            if (rounded_score > 1)
-            {
-                hash_to_count[it->first] = rounded_score;
-            }
-            else
+            for (size_t i = 0; i < batches[b].size; i++)
             {
-                skipped_hashes_after_rounding++;
+                if (abundances[b].abundances[i] * abundances[b].inv_mean_abundance < 0.0f)
+                {
+                    throw std::invalid_argument("kmer_dosage cannot be negative.");
+                }
             }
-            hash_to_score.erase(it);
         }
-        return skipped_hashes_after_rounding;
+
+        if constexpr (ScoreFormat<Dosage>::fixed_point)
+        {
+            const vector<vector<Dosage>> dosages = encode_scores(batches, abundances, format, HUGE_VAL, threads);
+            partitioned_ingest(hash_to_count, batches, threads,
+                               [&](auto &set, size_t hashval, uint32_t b, uint32_t i)
+                               {
+                                   std::tuple<uint32_t, Dosage> &value = submap_value(set, batches[b].hashes[i], hashval);
+                                   std::get<0>(value)++;
+                                   std::get<1>(value) = format.add(std::get<1>(value), dosages[b][i]);
+                               });
+        }
+        else
+        {
+            partitioned_ingest(hash_to_count, batches, threads,
+                               [&](auto &set, size_t hashval, uint32_t b, uint32_t i)
+                               {
+                                   std::tuple<uint32_t, float> &value = submap_value(set, batches[b].hashes[i], hashval);
+                                   std::get<0>(value)++;
+                                   std::get<1>(value) += abundances[b].abundances[i] * abundances[b].inv_mean_abundance;
+                               });
+        }
     }
 
-    unordered_map<uint64_t, uint32_t> get_kmers()
+    template <typename T>
+    void add_hashes(const HashArray &hashes, const AbundanceArray<T> &abundances, float mean_abundance)
     {
-        unordered_map<uint64_t, uint32_t> result;
-        for (auto it = hash_to_count.begin(); it != hash_to_count.end(); ++it)
+        check_same_size(hashes, abundances);
+        ingest<T>({{hashes.data(), hashes.shape(0)}}, {{abundances.data(), 1.0f / mean_abundance}});
+    }
+
+    template <typename T>
+    void add_many(const vector<HashArray> &hashes, const vector<AbundanceArray<T>> &abundances,
+                  const vector<float> &mean_abundances)
+    {
+        vector<AbundanceBatch<T>> abundance_batches = to_abundance_batches(hashes, abundances, mean_abundances);
+        ingest(to_batches(hashes), abundance_batches);
+    }
+
+    IngestStats add_signature_files(const vector<string> &paths, uint32_t ksize, int loaders, size_t queue_size,
+                                    const ProgressCallback &progress)
+    {
+        return load_signature_files(
+            paths, ksize, default_loaders(loaders, threads), queue_size, sketch, [&](const vector<DecodedSignature> &sigs)
+            { ingest(to_batches(sigs), to_abundance_batches(sigs)); }, progress);
+    }
+
+    uint32_t ksize() const
+    {
+        return sketch.ksize;
+    }
+
+    uint64_t scale() const
+    {
+        return sketch.scale;
+    }
+
+    void reserve(size_t n)
+    {
+        hash_to_count.reserve(n);
+    }
+
+    int fraction_bits() const
+    {
+        return format.bits();
+    }
+
+    // Adds the sample counts and dosages of a counter filled separately, one submap
+    // per worker; see BasicWeightedHashesCounter::merge.
+    void merge(const BasicSamplesKmerDosageHybridCounter &other)
+    {
+        if (&other == this)
         {
-            result[it->first] = it->second;
+            throw std::invalid_argument("A counter cannot be merged into itself.");
         }
-        return result;
+        if (rounded || other.rounded)
+        {
+            throw std::logic_error("Counters must be merged before round_scores().");
+        }
+        if (other.format.bits() != format.bits())
+        {
+            throw std::invalid_argument("Only counters with the same fraction_bits can be merged.");
+        }
+        sketch.merge(other.sketch);
+        parallel_for_each_index(Map::subcnt(), threads, [&](size_t sub)
+                                { other.hash_to_count.with_submap(sub, [&](const auto &from)
+                                                                  { hash_to_count.with_submap_m(sub, [&](auto &to)
+                                                                                                {
+                for (const auto &entry : from)
+                {
+                    std::tuple<uint32_t, Dosage> &value = submap_value(to, entry.first, hash_to_count.hash(entry.first));
+                    std::get<0>(value) += std::get<0>(entry.second);
+                    std::get<1>(value) = format.add(std::get<1>(value), std::get<1>(entry.second));
+                } }); }); });
     }
 
-    uint64_t size()
+    vector<size_t> submap_sizes() const
+    {
+        return ::submap_sizes(hash_to_count);
+    }
+
+    uint64_t size() const
+    {
+        return locked_size(hash_to_count);
+    }
+
+    // Sample count and dosage of `hash` (as a percentage once rounded), zeros when absent.
+    std::tuple<uint32_t, double> query(uint64_t hash) const
     {
-        return hash_to_count.size();
+        std::tuple<uint32_t, double> value(0, 0.0);
+        hash_to_count.if_contains(hash, [&](const typename Map::value_type &entry)
+                                  { value = std::make_tuple(std::get<0>(entry.second),
+                                                            format.decode(std::get<1>(entry.second)) * (rounded ? 100 : 1)); });
+        return value;
     }
 
-    // keep_min_abundance
-    void keep_min_abundance(uint32_t min_abundance)
+    vector<std::tuple<uint32_t, double>> query_many(const HashArray &hashes) const
     {
-        for (auto it = hash_to_count.begin(); it != hash_to_count.end();)
+        const uint64_t *data = hashes.data();
+        vector<std::tuple<uint32_t, double>> result(hashes.shape(0));
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (ptrdiff_t i = 0; i < static_cast<ptrdiff_t>(result.size()); i++)
         {
-            if (it->second < min_abundance)
-            {
-                it = hash_to_count.erase(it);
-            }
-            else
-            {
-                ++it;
-            }
+            result[i] = query(data[i]);
         }
+        return result;
     }
-};
 
-class WeightedHashesCounterUncapped : public WeightedHashesCounter
-{
-public:
-    WeightedHashesCounterUncapped() : WeightedHashesCounter() {}
+    // Drops hashes seen in fewer than 2 samples or whose dosage percentage rounds to 0.
+    // Calling it again does nothing.
+    uint64_t round_scores()
+    {
+        if (rounded)
+        {
+            return 0;
+        }
+        check_dosages();
+        rounded = true;
+        return parallel_erase_if(hash_to_count, threads, [&](const typename Map::value_type &entry)
+                                 { return std::get<0>(entry.second) < 2 ||
+                                          format.product_at_most_half(std::get<1>(entry.second), 100); });
+    }
+
+    unordered_map<uint64_t, std::tuple<uint32_t, uint32_t>> get_kmers() const
+    {
+        unordered_map<uint64_t, std::tuple<uint32_t, uint32_t>> result;
+        result.reserve(locked_size(hash_to_count));
+        for_each_entry(hash_to_count, [&](const typename Map::value_type &entry)
+                       { result[entry.first] = std::make_tuple(std::get<0>(entry.second),
+                                                               rounded_dosage(std::get<1>(entry.second))); });
+        return result;
+    }
+
+    vector<uint64_t> get_hashes() const
+    {
+        vector<uint64_t> result;
+        result.reserve(locked_size(hash_to_count));
+        for_each_entry(hash_to_count, [&](const typename Map::value_type &entry)
+                       { result.push_back(entry.first); });
+        return result;
+    }
+
+    vector<uint32_t> get_sample_counts() const
+    {
+        vector<uint32_t> result;
+        result.reserve(locked_size(hash_to_count));
+        for_each_entry(hash_to_count, [&](const typename Map::value_type &entry)
+                       { result.push_back(std::get<0>(entry.second)); });
+        return result;
+    }
 
-    void add_hashes(const vector<uint64_t> &hashes, const vector<float> &abundances, float mean_abundance)
+    vector<uint32_t> get_kmer_dosages() const
     {
-        const float inv_mean_abundance = 1.0f / mean_abundance;
-        const size_t n = hashes.size();
+        vector<uint32_t> result;
+        result.reserve(locked_size(hash_to_count));
+        for_each_entry(hash_to_count, [&](const typename Map::value_type &entry)
+                       { result.push_back(rounded_dosage(std::get<1>(entry.second))); });
+        return result;
+    }
 
-        for (size_t i = 0; i < n; i++)
+    // get_hashes(), get_sample_counts() and get_kmer_dosages() in one pass, in
+    // increasing hash order if `sorted`.
+    HybridColumns columns(bool sorted) const
+    {
+        HybridColumns result;
+        export_rows(hash_to_count, threads, every_entry, field(std::get<0>(result), entry_key),
+                    field(std::get<1>(result), [](const typename Map::value_type &entry)
+                          { return std::get<0>(entry.second); }),
+                    field(std::get<2>(result), [&](const typename Map::value_type &entry)
+                          { return rounded_dosage(std::get<1>(entry.second)); }));
+        if (sorted)
         {
-            hash_to_score[hashes[i]] += abundances[i] * inv_mean_abundance;
+            sort_by_hash(threads, result);
         }
+        return result;
     }
 };
 
-class SamplesKmerDosageHybridCounter
+// SamplesKmerDosageHybridCounter on CompactHashesCounter's layout: a 24-bit sample
+// count packed with the key remainder in one word plus a float dosage alongside,
+// 12 bytes per slot against 16 (plus phmap's control byte) for the tuple map. The
+// counter is built for one scale, like CompactHashesCounter.
+class PackedSamplesKmerDosageHybridCounter
 {
+private:
+    using Table = PackedPayloadTable<float>;
 
-public:
-    // Updated to store kmer_dosage as float internally
-    phmap::parallel_flat_hash_map<uint64_t, std::tuple<uint32_t, float>,
-                                  std::hash<uint64_t>, std::equal_to<uint64_t>,
-                                  std::allocator<std::pair<uint64_t, std::tuple<uint32_t, float>>>,
-                                  6, std::mutex>
-        hash_to_count;
+    PrefixLayout layout;
+    vector<Table> buckets;
+    // Buckets past the one holding max_hash never receive keys.
+    size_t used_buckets;
+    uint64_t configured_scale;
+
+    // Buckets are unsynchronised, so concurrent calls are serialised here.
+    std::mutex mutex;
 
-    SamplesKmerDosageHybridCounter() {}
+    int threads;
+    SketchParams sketch;
 
-    void add_hashes(const vector<uint64_t> &hashes, const vector<float> &abundances, float mean_abundance)
+    // Set by round_scores(), which scales dosages to percentages in place.
+    bool rounded = false;
+
+    void check_range(const vector<HashBatch> &batches) const
     {
-        if (hashes.size() != abundances.size())
+        const uint64_t max_key = layout.max_key();
+        for (const HashBatch &batch : batches)
         {
-            throw std::invalid_argument("hashes and abundances vectors must be of the same size.");
+            const uint64_t *largest = std::max_element(batch.hashes, batch.hashes + batch.size);
+            if (batch.size > 0 && *largest > max_key)
+            {
+                throw std::invalid_argument("Hash " + std::to_string(*largest) + " is above the max_hash of scale " +
+                                            std::to_string(configured_scale) + ".");
+            }
         }
+    }
 
-        const float inv_mean_abundance = 1.0f / mean_abundance;
-        const size_t n = hashes.size();
-        const uint32_t additional_sample_count = 1;
+    // Calls f(hash, sample_count, dosage) for every entry, in a fixed order.
+    template <typename F>
+    void for_each(F &&f) const
+    {
+        for (size_t b = 0; b < buckets.size(); b++)
+        {
+            buckets[b].for_each([&](uint64_t remainder, uint32_t count, float dosage)
+                                { f(layout.key(b, remainder), count, dosage); });
+        }
+    }
 
-        for (size_t i = 0; i < n; i++)
+public:
+    PackedSamplesKmerDosageHybridCounter(uint64_t scale, int threads = 1)
+        : layout(max_hash_for_scale(scale)), configured_scale(scale), threads(resolve_threads(threads))
+    {
+        if (scale == 0)
         {
-            float kmer_dosage = abundances[i] * inv_mean_abundance;
+            throw std::invalid_argument("scale must be positive.");
+        }
+        buckets.resize(layout.n_buckets());
+        used_buckets = layout.bucket(max_hash_for_scale(scale)) + 1;
+    }
 
-            // Optional: Handle cases where dosage might be negative or exceed expected ranges
-            if (kmer_dosage < 0.0f)
+    template <typename T>
+    void ingest(const vector<HashBatch> &batches, const vector<AbundanceBatch<T>> &abundances)
+    {
+        // Validate up front: nothing may throw once the parallel insert has started.
+        check_range(batches);
+        for (size_t b = 0; b < batches.size(); b++)
+        {
+            for (size_t i = 0; i < batches[b].size; i++)
             {
-                throw std::invalid_argument("kmer_dosage cannot be negative.");
+                if (abundances[b].abundances[i] * abundances[b].inv_mean_abundance < 0.0f)
+                {
+                    throw std::invalid_argument("kmer_dosage cannot be negative.");
+                }
             }
+        }
 
-            // Use try_emplace to optimize insertion
-            auto [it, inserted] = hash_to_count.try_emplace(hashes[i], 1, kmer_dosage);
-            if (!inserted)
+        std::lock_guard<std::mutex> lock(mutex);
+        if (total_batch_size(batches) < min_slice)
+        {
+            for (size_t b = 0; b < batches.size(); b++)
             {
-                std::get<0>(it->second)++;
-                std::get<1>(it->second) += kmer_dosage;
+                for (size_t i = 0; i < batches[b].size; i++)
+                {
+                    const uint64_t key = batches[b].hashes[i];
+                    buckets[layout.bucket(key)].add(layout.remainder(key), 1,
+                                                    abundances[b].abundances[i] * abundances[b].inv_mean_abundance);
+                }
             }
+            return;
+        }
+
+        partitioned_apply(
+            batches, buckets.size(), threads, [](uint64_t key)
+            { return static_cast<size_t>(key); },
+            [&](size_t key)
+            { return layout.bucket(key); },
+            [&](size_t b, const RoutedHash *begin, const RoutedHash *end)
+            {
+                Table &table = buckets[b];
+                for (const RoutedHash *r = begin; r < end; r++)
+                {
+                    if (static_cast<size_t>(end - r) > prefetch_distance)
+                    {
+                        table.prefetch(layout.remainder(r[prefetch_distance].hashval));
+                    }
+                    const AbundanceBatch<T> &abundance = abundances[r->batch];
+                    table.add(layout.remainder(r->hashval), 1, abundance.abundances[r->index] * abundance.inv_mean_abundance);
+                }
+            });
+    }
+
+    template <typename T>
+    void add_hashes(const HashArray &hashes, const AbundanceArray<T> &abundances, float mean_abundance)
+    {
+        check_same_size(hashes, abundances);
+        ingest<T>({{hashes.data(), hashes.shape(0)}}, {{abundances.data(), 1.0f / mean_abundance}});
+    }
+
+    template <typename T>
+    void add_many(const vector<HashArray> &hashes, const vector<AbundanceArray<T>> &abundances,
+                  const vector<float> &mean_abundances)
+    {
+        vector<AbundanceBatch<T>> abundance_batches = to_abundance_batches(hashes, abundances, mean_abundances);
+        ingest(to_batches(hashes), abundance_batches);
+    }
+
+    IngestStats add_signature_files(const vector<string> &paths, uint32_t ksize, int loaders, size_t queue_size,
+                                    const ProgressCallback &progress)
+    {
+        return load_signature_files(
+            paths, ksize, default_loaders(loaders, threads), queue_size, sketch, [&](const vector<DecodedSignature> &sigs)
+            {
+                for (const DecodedSignature &sig : sigs)
+                {
+                    if (sig.scale() != configured_scale)
+                    {
+                        throw std::invalid_argument("Signature '" + sig.source + "' has scale " + std::to_string(sig.scale()) +
+                                                    ", but this counter was built for scale " +
+                                                    std::to_string(configured_scale) + ".");
+                    }
+                }
+                ingest(to_batches(sigs), to_abundance_batches(sigs)); }, progress);
+    }
+
+    uint32_t ksize() const
+    {
+        return sketch.ksize;
+    }
+
+    uint64_t scale() const
+    {
+        return configured_scale;
+    }
+
+    void reserve(size_t n)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Tables are not rounded up to powers of two, so leave room for buckets
+        // filling two standard deviations above the mean; the few that overflow
+        // grow by half once.
+        const double mean = static_cast<double>(n) / used_buckets;
+        const size_t per_bucket = static_cast<size_t>(mean + 2 * std::sqrt(mean)) + 1;
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (ptrdiff_t b = 0; b < static_cast<ptrdiff_t>(used_buckets); b++)
+        {
+            buckets[b].reserve(per_bucket);
+        }
+    }
+
+    // Bytes held by the bucket tables.
+    uint64_t table_bytes() const
+    {
+        uint64_t bytes = buckets.size() * sizeof(Table);
+        for (const Table &table : buckets)
+        {
+            bytes += table.bytes();
         }
+        return bytes;
     }
 
     uint64_t size() const
     {
-        return hash_to_count.size();
+        uint64_t total = 0;
+        for (const Table &table : buckets)
+        {
+            total += table.size();
+        }
+        return total;
     }
 
-    // Filteration
     uint64_t round_scores()
     {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (rounded)
+        {
+            return 0;
+        }
+        rounded = true;
         uint64_t skipped_hashes_after_rounding = 0;
-        for (auto it = hash_to_count.begin(); it != hash_to_count.end();)
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 64) reduction(+ : skipped_hashes_after_rounding)
+        for (ptrdiff_t b = 0; b < static_cast<ptrdiff_t>(buckets.size()); b++)
         {
-            uint32_t &count = std::get<0>(it->second);
-            float dosage = std::get<1>(it->second);
-
-            dosage *= 100.0f;
-            std::get<1>(it->second) = dosage;
-
-            if (count < 2 || dosage <= 0.5f)
-            {
-                skipped_hashes_after_rounding++;
-                it = hash_to_count.erase(it);
-            }
-            else
-            {
-                ++it;
-            }
+            skipped_hashes_after_rounding += buckets[b].filter([](uint32_t count, float &dosage)
+                                                               {
+                dosage *= 100.0f;
+                return !(count < 2 || dosage <= 0.5f); });
         }
         return skipped_hashes_after_rounding;
     }
@@ -259,83 +2547,447 @@ public:
     unordered_map<uint64_t, std::tuple<uint32_t, uint32_t>> get_kmers() const
     {
         unordered_map<uint64_t, std::tuple<uint32_t, uint32_t>> result;
-        result.reserve(hash_to_count.size()); // Optimize by reserving space
-        for (const auto &it : hash_to_count)
-        {
-            // Convert float dosage to uint32_t, using rounding to nearest integer
-            uint32_t rounded_dosage = static_cast<uint32_t>(std::round(std::get<1>(it.second)));
-            result[it.first] = std::make_tuple(std::get<0>(it.second), rounded_dosage);
-        }
+        result.reserve(size());
+        for_each([&](uint64_t hash, uint32_t count, float dosage)
+                 { result[hash] = std::make_tuple(count, static_cast<uint32_t>(std::round(dosage))); });
         return result;
     }
 
     vector<uint64_t> get_hashes() const
     {
         vector<uint64_t> result;
-        result.reserve(hash_to_count.size());
-        for (const auto &it : hash_to_count)
-        {
-            result.push_back(it.first);
-        }
+        result.reserve(size());
+        for_each([&](uint64_t hash, uint32_t, float)
+                 { result.push_back(hash); });
         return result;
     }
 
     vector<uint32_t> get_sample_counts() const
     {
         vector<uint32_t> result;
-        result.reserve(hash_to_count.size());
-        for (const auto &it : hash_to_count)
-        {
-            result.push_back(std::get<0>(it.second));
-        }
+        result.reserve(size());
+        for_each([&](uint64_t, uint32_t count, float)
+                 { result.push_back(count); });
         return result;
     }
 
     vector<uint32_t> get_kmer_dosages() const
     {
         vector<uint32_t> result;
-        result.reserve(hash_to_count.size());
-        for (const auto &it : hash_to_count)
-        {
-            uint32_t rounded_dosage = static_cast<uint32_t>(std::round(std::get<1>(it.second)));
-            result.push_back(rounded_dosage);
-        }
+        result.reserve(size());
+        for_each([&](uint64_t, uint32_t, float dosage)
+                 { result.push_back(static_cast<uint32_t>(std::round(dosage))); });
         return result;
     }
+
+    // get_hashes(), get_sample_counts() and get_kmer_dosages() in one pass, one bucket
+    // per worker. Buckets follow the key prefix, so `sorted` only has to sort within
+    // each bucket's rows.
+    HybridColumns columns(bool sorted) const
+    {
+        HybridColumns result;
+        Column<uint64_t> &hashes = std::get<0>(result);
+        Column<uint32_t> &counts = std::get<1>(result);
+        Column<uint32_t> &dosages = std::get<2>(result);
+        export_parts(buckets.size(), threads, [&](size_t b)
+                     { return buckets[b].size(); },
+                     [&](size_t b, size_t row)
+                     {
+                const size_t first_row = row;
+                buckets[b].for_each([&](uint64_t remainder, uint32_t count, float dosage)
+                                    {
+                    hashes.data[row] = layout.key(b, remainder);
+                    counts.data[row] = count;
+                    dosages.data[row] = static_cast<uint32_t>(std::round(dosage));
+                    row++; });
+                if (sorted)
+                {
+                    sort_range_by_hash(first_row, row, hashes, counts, dosages);
+                } },
+                     hashes, counts, dosages);
+        return result;
+    }
+};
+
+// The exposed counters are keyed by FracMinHash values, which need no further mixing.
+using HashesCounter = BasicHashesCounter<FracMinHash>;
+using HugePageHashesCounter = BasicHashesCounter<FracMinHash, HugePageAllocator>;
+using HashesCounter8 = BasicSmallHashesCounter<FracMinHash, uint8_t>;
+using HashesCounter16 = BasicSmallHashesCounter<FracMinHash, uint16_t>;
+using SpillingHashesCounter = BasicSpillingHashesCounter<FracMinHash>;
+using WeightedHashesCounter = BasicWeightedHashesCounter<FracMinHash>;
+using WeightedHashesCounterUncapped = BasicWeightedHashesCounterUncapped<FracMinHash>;
+using SamplesKmerDosageHybridCounter = BasicSamplesKmerDosageHybridCounter<FracMinHash>;
+using FixedWeightedHashesCounter = BasicWeightedHashesCounter<FracMinHash, uint32_t>;
+using FixedWeightedHashesCounter64 = BasicWeightedHashesCounter<FracMinHash, uint64_t>;
+using FixedSamplesKmerDosageHybridCounter = BasicSamplesKmerDosageHybridCounter<FracMinHash, uint32_t>;
+using FixedSamplesKmerDosageHybridCounter64 = BasicSamplesKmerDosageHybridCounter<FracMinHash, uint64_t>;
+
+// Lock-policy variants (see CounterMap): Unlocked for callers that never overlap
+// calls (their bindings keep the GIL to enforce that from Python), Concurrent for
+// lookups that run alongside each other and alongside ingest.
+using UnlockedHashesCounter = BasicHashesCounter<FracMinHash, std::allocator, phmap::NullMutex>;
+using ConcurrentHashesCounter = BasicHashesCounter<FracMinHash, std::allocator, std::shared_mutex>;
+using UnlockedWeightedHashesCounter = BasicWeightedHashesCounter<FracMinHash, float, phmap::NullMutex>;
+using ConcurrentWeightedHashesCounter = BasicWeightedHashesCounter<FracMinHash, float, std::shared_mutex>;
+using UnlockedSamplesKmerDosageHybridCounter = BasicSamplesKmerDosageHybridCounter<FracMinHash, float, phmap::NullMutex>;
+using ConcurrentSamplesKmerDosageHybridCounter = BasicSamplesKmerDosageHybridCounter<FracMinHash, float, std::shared_mutex>;
+
+template <typename T>
+using NumpyArray = nb::ndarray<nb::numpy, T, nb::ndim<1>>;
+
+// Guard for bound methods that do real work. Counters on phmap::NullMutex (the
+// Unlocked variants) have no locks of their own, so those keep the GIL: overlapping
+// Python calls then queue up on it instead of racing on the submaps.
+struct keep_gil
+{
+    keep_gil() {}
+};
+
+template <typename Counter>
+struct GilPolicy
+{
+    using guard = nb::gil_scoped_release;
+};
+
+template <typename Hash, template <typename> class Allocator>
+struct GilPolicy<BasicHashesCounter<Hash, Allocator, phmap::NullMutex>>
+{
+    using guard = keep_gil;
 };
 
+template <typename Hash, typename Score>
+struct GilPolicy<BasicWeightedHashesCounter<Hash, Score, phmap::NullMutex>>
+{
+    using guard = keep_gil;
+};
+
+template <typename Hash, typename Dosage>
+struct GilPolicy<BasicSamplesKmerDosageHybridCounter<Hash, Dosage, phmap::NullMutex>>
+{
+    using guard = keep_gil;
+};
+
+template <typename Counter>
+using release_gil = typename GilPolicy<Counter>::guard;
+
+// Hands a column to NumPy without copying; the array's capsule frees the buffer.
+template <typename T>
+static NumpyArray<T> to_numpy(Column<T> column)
+{
+    T *data = column.data.release();
+    nb::capsule owner(data, [](void *p) noexcept
+                      { delete[] static_cast<T *>(p); });
+    return NumpyArray<T>(data, {column.size}, owner);
+}
+
+template <typename... T>
+static std::tuple<NumpyArray<T>...> to_numpy(std::tuple<Column<T>...> columns)
+{
+    return std::apply([](Column<T> &...column)
+                      { return std::make_tuple(to_numpy(std::move(column))...); },
+                      columns);
+}
+
+// Runs `fill` under `Guard` (by default with the GIL released) and hands the columns
+// it returns to NumPy once the GIL is held again.
+template <typename Guard = nb::gil_scoped_release, typename Fill>
+static auto fill_numpy(Fill &&fill)
+{
+    decltype(fill()) columns;
+    {
+        Guard guard;
+        columns = fill();
+    }
+    return to_numpy(std::move(columns));
+}
+
+// Binds a counter method returning columns as one returning NumPy arrays.
+template <typename Counter, typename Class, typename Result, typename... Args>
+static auto numpy_method(Result (Class::*method)(Args...) const)
+{
+    return [method](const Counter &counter, Args... args)
+    { return fill_numpy<release_gil<Counter>>([&]
+                                              { return (counter.*method)(args...); }); };
+}
+
+template <typename Counter, typename Class, typename Result, typename... Args>
+static auto numpy_method(Result (Class::*method)(Args...))
+{
+    return [method](Counter &counter, Args... args)
+    { return fill_numpy<release_gil<Counter>>([&]
+                                              { return (counter.*method)(args...); }); };
+}
+
+// Ingest and sketch-parameter methods of the plain (unweighted) counters.
+template <typename Counter>
+static nb::class_<Counter> &bind_count_ingest(nb::class_<Counter> &cls)
+{
+    return cls
+        .def("add_hashes", &Counter::add_hashes, nb::arg("hashes"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_many", &Counter::add_many, nb::arg("hashes"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_signature_files", &Counter::add_signature_files,
+             nb::arg("paths"), nb::arg("ksize") = 0, nb::arg("loaders") = 0, nb::arg("queue_size") = 0,
+             nb::arg("progress") = nb::none(), nb::call_guard<release_gil<Counter>>())
+        .def("ksize", &Counter::ksize)
+        .def("scale", &Counter::scale);
+}
+
+// Filter and export methods of the exact plain counters.
+template <typename Counter>
+static nb::class_<Counter> &bind_count_export(nb::class_<Counter> &cls)
+{
+    return cls
+        .def("remove_singletons", &Counter::remove_singletons, nb::call_guard<release_gil<Counter>>())
+        .def("keep_min_abundance", &Counter::keep_min_abundance,
+             nb::call_guard<release_gil<Counter>>())
+        .def("get_kmers", &Counter::get_kmers)
+        .def("get_hashes_array", numpy_method<Counter>(&Counter::hashes_column))
+        .def("get_counts_array", numpy_method<Counter>(&Counter::counts_column))
+        .def("export", numpy_method<Counter>(&Counter::export_counts), nb::arg("min_abund") = 0,
+             nb::arg("drop_singletons") = true, nb::arg("sorted") = false);
+}
+
+// Bindings shared by the variants of a counter family (allocator, lock policy, score
+// type). Each variant adds its constructor and any methods of its own.
+template <typename Counter>
+static void bind_hashes_counter(nb::module_ &m, const char *name)
+{
+    nb::class_<Counter> cls(m, name);
+    bind_count_ingest(cls);
+    bind_count_export(cls)
+        .def(nb::init<int>(), nb::arg("threads") = 1)
+        .def("reserve", &Counter::reserve, nb::arg("n"), nb::call_guard<release_gil<Counter>>())
+        .def("submap_sizes", &Counter::submap_sizes)
+        .def("screen_singletons", &Counter::screen_singletons, nb::arg("expected_distinct"),
+             nb::arg("bits_per_hash") = 10.0)
+        .def("bloom_stats", &Counter::bloom_stats)
+        .def("query", &Counter::query, nb::arg("hash"))
+        .def("query_many", &Counter::query_many, nb::arg("hashes"), nb::call_guard<release_gil<Counter>>())
+        .def("size", &Counter::size);
+}
+
+template <typename Counter>
+static void bind_small_counter(nb::module_ &m, const char *name)
+{
+    nb::class_<Counter> cls(m, name);
+    bind_count_ingest(cls);
+    bind_count_export(cls)
+        .def(nb::init<int>(), nb::arg("threads") = 1)
+        .def("reserve", &Counter::reserve, nb::arg("n"), nb::call_guard<release_gil<Counter>>())
+        .def("table_bytes", &Counter::table_bytes)
+        .def("overflow_size", &Counter::overflow_size)
+        .def("size", &Counter::size);
+}
+
+template <typename Counter>
+static nb::class_<Counter> bind_weighted_counter(nb::module_ &m, const char *name)
+{
+    return nb::class_<Counter>(m, name)
+        .def("add_hashes", &Counter::template add_hashes<float>,
+             nb::arg("hashes"), nb::arg("abundances"), nb::arg("mean_abundance"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_hashes", &Counter::template add_hashes<uint32_t>,
+             nb::arg("hashes"), nb::arg("abundances"), nb::arg("mean_abundance"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_many", &Counter::template add_many<float>,
+             nb::arg("hashes"), nb::arg("abundances"), nb::arg("mean_abundances"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_many", &Counter::template add_many<uint32_t>,
+             nb::arg("hashes"), nb::arg("abundances"), nb::arg("mean_abundances"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_signature_files", &Counter::add_signature_files,
+             nb::arg("paths"), nb::arg("ksize") = 0, nb::arg("loaders") = 0, nb::arg("queue_size") = 0,
+             nb::arg("progress") = nb::none(), nb::call_guard<release_gil<Counter>>())
+        .def("ksize", &Counter::ksize)
+        .def("scale", &Counter::scale)
+        .def("reserve", &Counter::reserve, nb::arg("n"), nb::call_guard<release_gil<Counter>>())
+        .def("submap_sizes", &Counter::submap_sizes)
+        .def("query", &Counter::query, nb::arg("hash"))
+        .def("query_many", &Counter::query_many, nb::arg("hashes"), nb::call_guard<release_gil<Counter>>())
+        .def("merge", &Counter::merge, nb::arg("other"), nb::call_guard<release_gil<Counter>>())
+        .def("round_scores", &Counter::round_scores, nb::call_guard<release_gil<Counter>>())
+        .def("get_kmers", &Counter::get_kmers)
+        .def("get_hashes_array", numpy_method<Counter>(&Counter::hashes_column))
+        .def("get_counts_array", numpy_method<Counter>(&Counter::counts_column))
+        .def("export", numpy_method<Counter>(&Counter::export_counts), nb::arg("min_abund") = 0,
+             nb::arg("drop_singletons") = true, nb::arg("sorted") = false)
+        .def("size", &Counter::size)
+        .def("keep_min_abundance", &Counter::keep_min_abundance,
+             nb::call_guard<release_gil<Counter>>());
+}
+
+// Ingest, rounding and export methods shared by the hybrid counters, whatever their
+// table layout.
+template <typename Counter>
+static nb::class_<Counter> &bind_hybrid_methods(nb::class_<Counter> &cls)
+{
+    return cls
+        .def("add_hashes", &Counter::template add_hashes<float>,
+             nb::arg("hashes"), nb::arg("abundances"), nb::arg("mean_abundance"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_hashes", &Counter::template add_hashes<uint32_t>,
+             nb::arg("hashes"), nb::arg("abundances"), nb::arg("mean_abundance"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_many", &Counter::template add_many<float>,
+             nb::arg("hashes"), nb::arg("abundances"), nb::arg("mean_abundances"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_many", &Counter::template add_many<uint32_t>,
+             nb::arg("hashes"), nb::arg("abundances"), nb::arg("mean_abundances"),
+             nb::call_guard<release_gil<Counter>>())
+        .def("add_signature_files", &Counter::add_signature_files,
+             nb::arg("paths"), nb::arg("ksize") = 0, nb::arg("loaders") = 0, nb::arg("queue_size") = 0,
+             nb::arg("progress") = nb::none(), nb::call_guard<release_gil<Counter>>())
+        .def("ksize", &Counter::ksize)
+        .def("scale", &Counter::scale)
+        .def("reserve", &Counter::reserve, nb::arg("n"), nb::call_guard<release_gil<Counter>>())
+        .def("round_scores", &Counter::round_scores, nb::call_guard<release_gil<Counter>>())
+        .def("size", &Counter::size)
+        .def("get_kmers", &Counter::get_kmers)
+        .def("get_columns", numpy_method<Counter>(&Counter::columns), nb::arg("sorted") = false)
+        .def("get_hashes", &Counter::get_hashes)
+        .def("get_sample_counts", &Counter::get_sample_counts)
+        .def("get_kmer_dosages", &Counter::get_kmer_dosages);
+}
+
+template <typename Counter>
+static nb::class_<Counter> bind_hybrid_counter(nb::module_ &m, const char *name)
+{
+    nb::class_<Counter> cls(m, name);
+    bind_hybrid_methods(cls)
+        .def("submap_sizes", &Counter::submap_sizes)
+        .def("query", &Counter::query, nb::arg("hash"))
+        .def("query_many", &Counter::query_many, nb::arg("hashes"), nb::call_guard<release_gil<Counter>>())
+        .def("merge", &Counter::merge, nb::arg("other"), nb::call_guard<release_gil<Counter>>());
+    return cls;
+}
+
 NB_MODULE(_hashes_counter_impl, m)
 {
-    nb::class_<HashesCounter>(m, "HashesCounter")
-        .def(nb::init<>())
-        .def("add_hashes", &HashesCounter::add_hashes)
-        .def("remove_singletons", &HashesCounter::remove_singletons)
-        .def("keep_min_abundance", &HashesCounter::keep_min_abundance)
-        .def("get_kmers", &HashesCounter::get_kmers)
-        .def("size", &HashesCounter::size);
-
-    nb::class_<WeightedHashesCounter>(m, "WeightedHashesCounter")
-        .def(nb::init<>())
-        .def("add_hashes", &WeightedHashesCounter::add_hashes)
-        .def("round_scores", &WeightedHashesCounter::round_scores)
-        .def("get_kmers", &WeightedHashesCounter::get_kmers)
-        .def("size", &WeightedHashesCounter::size);
-
-    nb::class_<WeightedHashesCounterUncapped>(m, "WeightedHashesCounterUncapped")
-        .def(nb::init<>())
-        .def("add_hashes", &WeightedHashesCounterUncapped::add_hashes)
-        .def("round_scores", &WeightedHashesCounterUncapped::round_scores)
-        .def("get_kmers", &WeightedHashesCounterUncapped::get_kmers)
-        .def("size", &WeightedHashesCounterUncapped::size)
-        .def("keep_min_abundance", &WeightedHashesCounterUncapped::keep_min_abundance);
-
-    nb::class_<SamplesKmerDosageHybridCounter>(m, "SamplesKmerDosageHybridCounter")
-        .def(nb::init<>())
-        .def("add_hashes", &SamplesKmerDosageHybridCounter::add_hashes)
-        .def("round_scores", &SamplesKmerDosageHybridCounter::round_scores)
-        .def("size", &SamplesKmerDosageHybridCounter::size)
-        .def("get_kmers", &SamplesKmerDosageHybridCounter::get_kmers)
-        .def("get_hashes", &SamplesKmerDosageHybridCounter::get_hashes)
-        .def("get_sample_counts", &SamplesKmerDosageHybridCounter::get_sample_counts)
-        .def("get_kmer_dosages", &SamplesKmerDosageHybridCounter::get_kmer_dosages);
+    nb::class_<IngestStats>(m, "IngestStats")
+        .def_ro("signatures", &IngestStats::signatures)
+        .def_ro("hashes", &IngestStats::hashes)
+        .def_ro("loaders", &IngestStats::loaders)
+        .def_ro("wall_seconds", &IngestStats::wall_seconds)
+        .def_ro("decode_seconds", &IngestStats::decode_seconds)
+        .def_ro("loader_blocked_seconds", &IngestStats::loader_blocked_seconds)
+        .def_ro("insert_seconds", &IngestStats::insert_seconds)
+        .def_ro("consumer_idle_seconds", &IngestStats::consumer_idle_seconds);
+
+    nb::class_<CardinalityEstimate>(m, "CardinalityEstimate")
+        .def_ro("distinct", &CardinalityEstimate::distinct)
+        .def_ro("upper_bound", &CardinalityEstimate::upper_bound)
+        .def_ro("signatures", &CardinalityEstimate::signatures)
+        .def_ro("seconds", &CardinalityEstimate::seconds);
+
+    nb::class_<SignatureInfo>(m, "SignatureInfo")
+        .def_ro("ksize", &SignatureInfo::ksize)
+        .def_ro("scale", &SignatureInfo::scale)
+        .def_ro("n_hashes", &SignatureInfo::n_hashes)
+        .def_ro("name", &SignatureInfo::name);
+
+    nb::class_<BloomStats>(m, "BloomStats")
+        .def_ro("filter_bytes", &BloomStats::filter_bytes)
+        .def_ro("first_sightings", &BloomStats::first_sightings)
+        .def_ro("promoted", &BloomStats::promoted)
+        .def_ro("screened", &BloomStats::screened)
+        .def_ro("false_positive_rate", &BloomStats::false_positive_rate)
+        .def_ro("slot_bytes_avoided", &BloomStats::slot_bytes_avoided);
+
+    m.def("signature_info", &signature_info, nb::arg("path"), nb::arg("ksize") = 0,
+          nb::call_guard<nb::gil_scoped_release>());
+
+    m.def("write_signature", &write_signature_arrays, nb::arg("path"), nb::arg("hashes"), nb::arg("abundances"),
+          nb::arg("ksize"), nb::arg("scale"), nb::arg("name") = "", nb::arg("filename") = "",
+          nb::arg("md5sum") = true, nb::arg("compression") = 1, nb::arg("threads") = 1,
+          nb::call_guard<nb::gil_scoped_release>());
+
+    m.def("estimate_cardinality", &estimate_cardinality, nb::arg("paths"), nb::arg("ksize") = 0,
+          nb::arg("method") = "hll", nb::arg("loaders") = 0, nb::call_guard<nb::gil_scoped_release>());
+
+    bind_hashes_counter<HashesCounter>(m, "HashesCounter");
+    bind_hashes_counter<UnlockedHashesCounter>(m, "UnlockedHashesCounter");
+    bind_hashes_counter<ConcurrentHashesCounter>(m, "ConcurrentHashesCounter");
+    bind_hashes_counter<HugePageHashesCounter>(m, "HugePageHashesCounter");
+
+    nb::class_<SortedHashesCounter> sorted_counter(m, "SortedHashesCounter");
+    bind_count_ingest(sorted_counter);
+    bind_count_export(sorted_counter)
+        .def(nb::init<int, size_t>(), nb::arg("threads") = 1, nb::arg("buffer_size") = size_t(1) << 24)
+        .def("reserve", &SortedHashesCounter::reserve, nb::arg("n"), nb::call_guard<nb::gil_scoped_release>())
+        .def("get_hashes", &SortedHashesCounter::get_hashes)
+        .def("get_counts", &SortedHashesCounter::get_counts)
+        .def("size", &SortedHashesCounter::size, nb::call_guard<nb::gil_scoped_release>());
+
+    nb::class_<CompactHashesCounter> compact_counter(m, "CompactHashesCounter");
+    bind_count_ingest(compact_counter);
+    bind_count_export(compact_counter)
+        .def(nb::init<uint64_t, int>(), nb::arg("scale"), nb::arg("threads") = 1)
+        .def("reserve", &CompactHashesCounter::reserve, nb::arg("n"), nb::call_guard<nb::gil_scoped_release>())
+        .def("table_bytes", &CompactHashesCounter::table_bytes)
+        .def("size", &CompactHashesCounter::size);
+
+    bind_small_counter<HashesCounter8>(m, "HashesCounter8");
+    bind_small_counter<HashesCounter16>(m, "HashesCounter16");
+
+    nb::class_<SpillingHashesCounter> spilling_counter(m, "SpillingHashesCounter");
+    bind_count_ingest(spilling_counter);
+    bind_count_export(spilling_counter)
+        .def(nb::init<size_t, int, const string &, size_t>(), nb::arg("memory_bytes"), nb::arg("threads") = 1,
+             nb::arg("temp_dir") = "", nb::arg("partitions") = 1024)
+        .def("spill_count", &SpillingHashesCounter::spill_count)
+        .def("spilled_bytes", &SpillingHashesCounter::spilled_bytes)
+        .def("get_columns", numpy_method<SpillingHashesCounter>(&SpillingHashesCounter::count_columns))
+        .def("size", &SpillingHashesCounter::size, nb::call_guard<nb::gil_scoped_release>());
+
+    nb::class_<ApproxHashesCounter> approx_counter(m, "ApproxHashesCounter");
+    bind_count_ingest(approx_counter)
+        .def(nb::init<size_t, int, uint32_t>(), nb::arg("memory_bytes"), nb::arg("threads") = 1,
+             nb::arg("heavy_threshold") = 2)
+        .def("query", &ApproxHashesCounter::query, nb::arg("hash"))
+        .def("query_many", &ApproxHashesCounter::query_many, nb::arg("hashes"),
+             nb::call_guard<nb::gil_scoped_release>())
+        .def("heavy_hitters", &ApproxHashesCounter::heavy_hitters, nb::arg("min_count") = 0)
+        .def("total", &ApproxHashesCounter::total)
+        .def("sketch_bytes", &ApproxHashesCounter::sketch_bytes)
+        .def("candidate_count", &ApproxHashesCounter::candidate_count);
+
+    bind_weighted_counter<WeightedHashesCounter>(m, "WeightedHashesCounter")
+        .def(nb::init<int>(), nb::arg("threads") = 1);
+    bind_weighted_counter<WeightedHashesCounterUncapped>(m, "WeightedHashesCounterUncapped")
+        .def(nb::init<int>(), nb::arg("threads") = 1);
+    bind_weighted_counter<UnlockedWeightedHashesCounter>(m, "UnlockedWeightedHashesCounter")
+        .def(nb::init<int, bool>(), nb::arg("threads") = 1, nb::arg("capped") = true);
+    bind_weighted_counter<ConcurrentWeightedHashesCounter>(m, "ConcurrentWeightedHashesCounter")
+        .def(nb::init<int, bool>(), nb::arg("threads") = 1, nb::arg("capped") = true);
+    bind_weighted_counter<FixedWeightedHashesCounter>(m, "FixedWeightedHashesCounter")
+        .def(nb::init<int, bool, int>(), nb::arg("threads") = 1, nb::arg("capped") = true,
+             nb::arg("fraction_bits") = ScoreFormat<uint32_t>::default_fraction_bits())
+        .def("fraction_bits", &FixedWeightedHashesCounter::fraction_bits);
+    bind_weighted_counter<FixedWeightedHashesCounter64>(m, "FixedWeightedHashesCounter64")
+        .def(nb::init<int, bool, int>(), nb::arg("threads") = 1, nb::arg("capped") = true,
+             nb::arg("fraction_bits") = ScoreFormat<uint64_t>::default_fraction_bits())
+        .def("fraction_bits", &FixedWeightedHashesCounter64::fraction_bits);
+
+    bind_hybrid_counter<SamplesKmerDosageHybridCounter>(m, "SamplesKmerDosageHybridCounter")
+        .def(nb::init<int>(), nb::arg("threads") = 1);
+    bind_hybrid_counter<UnlockedSamplesKmerDosageHybridCounter>(m, "UnlockedSamplesKmerDosageHybridCounter")
+        .def(nb::init<int>(), nb::arg("threads") = 1);
+    bind_hybrid_counter<ConcurrentSamplesKmerDosageHybridCounter>(m, "ConcurrentSamplesKmerDosageHybridCounter")
+        .def(nb::init<int>(), nb::arg("threads") = 1);
+    bind_hybrid_counter<FixedSamplesKmerDosageHybridCounter>(m, "FixedSamplesKmerDosageHybridCounter")
+        .def(nb::init<int, int>(), nb::arg("threads") = 1,
+             nb::arg("fraction_bits") = ScoreFormat<uint32_t>::default_fraction_bits())
+        .def("fraction_bits", &FixedSamplesKmerDosageHybridCounter::fraction_bits);
+    bind_hybrid_counter<FixedSamplesKmerDosageHybridCounter64>(m, "FixedSamplesKmerDosageHybridCounter64")
+        .def(nb::init<int, int>(), nb::arg("threads") = 1,
+             nb::arg("fraction_bits") = ScoreFormat<uint64_t>::default_fraction_bits())
+        .def("fraction_bits", &FixedSamplesKmerDosageHybridCounter64::fraction_bits);
+
+    nb::class_<PackedSamplesKmerDosageHybridCounter> packed_hybrid(m, "PackedSamplesKmerDosageHybridCounter");
+    bind_hybrid_methods(packed_hybrid)
+        .def(nb::init<uint64_t, int>(), nb::arg("scale"), nb::arg("threads") = 1)
+        .def("table_bytes", &PackedSamplesKmerDosageHybridCounter::table_bytes);
 }
\ No newline at end of file
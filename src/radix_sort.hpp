@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <vector>
+
+// Sorts `data` with a least-significant-digit radix sort on 11-bit digits, using
+// `scratch` as the ping-pong buffer (its contents are clobbered).
+//
+// The input is cut into one contiguous chunk per worker. Every pass builds a digit
+// histogram per chunk, turns them into per-chunk write offsets and scatters each
+// chunk independently, so the sort stays stable and no two workers write the same
+// slot. Digits on which every key agrees are skipped: FracMinHash values are below
+// max_hash, so their top bits are zero and the highest digit usually is constant.
+// 11-bit digits (six passes, 16 KiB histograms) measured faster than 8 or 16 bits.
+inline void radix_sort(std::vector<uint64_t> &data, std::vector<uint64_t> &scratch, int threads)
+{
+    constexpr int digit_bits = 11;
+    constexpr size_t n_buckets = size_t(1) << digit_bits;
+    constexpr int n_digits = (64 + digit_bits - 1) / digit_bits;
+    using Histogram = std::array<size_t, n_buckets>;
+
+    const size_t n = data.size();
+    const size_t min_chunk = size_t(1) << 16;
+    const size_t n_chunks = std::max<size_t>(1, std::min<size_t>(std::max(threads, 1), n / min_chunk));
+    const size_t chunk_len = (n + n_chunks - 1) / std::max<size_t>(n_chunks, 1);
+    const auto chunk_begin = [&](size_t c)
+    { return std::min(n, c * chunk_len); };
+    scratch.resize(n);
+
+    // Histograms of every digit over the input layout: they find the trivial digits
+    // and serve as the per-chunk counts of the first pass that is not skipped.
+    std::vector<std::array<Histogram, n_digits>> initial(n_chunks);
+#pragma omp parallel for num_threads(threads) schedule(static)
+    for (ptrdiff_t c = 0; c < static_cast<ptrdiff_t>(n_chunks); c++)
+    {
+        for (Histogram &h : initial[c])
+        {
+            h.fill(0);
+        }
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++)
+        {
+            const uint64_t key = data[i];
+            for (int d = 0; d < n_digits; d++)
+            {
+                initial[c][d][(key >> (digit_bits * d)) & (n_buckets - 1)]++;
+            }
+        }
+    }
+
+    uint64_t *src = data.data();
+    uint64_t *dst = scratch.data();
+    bool first_pass = true;
+    std::vector<Histogram> counts(n_chunks);
+    for (int d = 0; d < n_digits; d++)
+    {
+        const int shift = digit_bits * d;
+        size_t largest_bucket = 0;
+        for (size_t bucket = 0; bucket < n_buckets; bucket++)
+        {
+            size_t total = 0;
+            for (size_t c = 0; c < n_chunks; c++)
+            {
+                total += initial[c][d][bucket];
+            }
+            largest_bucket = std::max(largest_bucket, total);
+        }
+        if (largest_bucket == n)
+        {
+            continue;
+        }
+
+        if (first_pass)
+        {
+            for (size_t c = 0; c < n_chunks; c++)
+            {
+                counts[c] = initial[c][d];
+            }
+            first_pass = false;
+        }
+        else
+        {
+#pragma omp parallel for num_threads(threads) schedule(static)
+            for (ptrdiff_t c = 0; c < static_cast<ptrdiff_t>(n_chunks); c++)
+            {
+                counts[c].fill(0);
+                for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++)
+                {
+                    counts[c][(src[i] >> shift) & (n_buckets - 1)]++;
+                }
+            }
+        }
+
+        // Bucket-major, chunk-minor offsets keep equal digits in input order.
+        size_t position = 0;
+        for (size_t bucket = 0; bucket < n_buckets; bucket++)
+        {
+            for (size_t c = 0; c < n_chunks; c++)
+            {
+                const size_t count = counts[c][bucket];
+                counts[c][bucket] = position;
+                position += count;
+            }
+        }
+
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (ptrdiff_t c = 0; c < static_cast<ptrdiff_t>(n_chunks); c++)
+        {
+            Histogram &cursor = counts[c];
+            for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++)
+            {
+                const uint64_t key = src[i];
+                dst[cursor[(key >> shift) & (n_buckets - 1)]++] = key;
+            }
+        }
+        std::swap(src, dst);
+    }
+
+    if (src != data.data())
+    {
+        data.swap(scratch);
+    }
+}
+
+// Returns rows row_of(0), ..., row_of(n - 1) ordered by their key, std::get<0>(row),
+// with one most-significant-digit radix pass followed by independent bucket sorts.
+//
+// The pass scatters rows on the top bits of the range the keys span (FracMinHash
+// values share their leading zero bits), so buckets come out in key order and are
+// simply concatenated; no merge is needed. Histograms and scatter are per input
+// chunk as in radix_sort. The digit is wide enough for a few hundred rows per bucket,
+// up to 16 bits: wider digits shrink the bucket sorts, which measured faster until
+// the scatter dominated. Equal keys are not kept in input order.
+template <typename Row, typename RowOf>
+std::vector<Row> msd_radix_sort(size_t n, int threads, RowOf &&row_of)
+{
+    int digit_bits = 8;
+    while (digit_bits < 16 && (n >> digit_bits) > 256)
+    {
+        digit_bits++;
+    }
+    const size_t n_buckets = size_t(1) << digit_bits;
+    const auto key_of = [&](size_t i)
+    { return static_cast<uint64_t>(std::get<0>(row_of(i))); };
+
+    std::vector<Row> sorted(n);
+    const size_t min_chunk = size_t(1) << 16;
+    const size_t n_chunks = std::max<size_t>(1, std::min<size_t>(std::max(threads, 1), n / min_chunk));
+    const size_t chunk_len = (n + n_chunks - 1) / n_chunks;
+    const auto chunk_begin = [&](size_t c)
+    { return std::min(n, c * chunk_len); };
+
+    // Bits above the highest one on which some keys differ are shared by all.
+    std::vector<uint64_t> low(n_chunks, ~uint64_t(0)), high(n_chunks, 0);
+#pragma omp parallel for num_threads(threads) schedule(static)
+    for (ptrdiff_t c = 0; c < static_cast<ptrdiff_t>(n_chunks); c++)
+    {
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++)
+        {
+            low[c] = std::min(low[c], key_of(i));
+            high[c] = std::max(high[c], key_of(i));
+        }
+    }
+    const uint64_t spread = *std::max_element(high.begin(), high.end()) ^ *std::min_element(low.begin(), low.end());
+    int span = 0;
+    while (span < 64 && (spread >> span) != 0)
+    {
+        span++;
+    }
+    const int shift = std::max(span - digit_bits, 0);
+
+    std::vector<std::vector<size_t>> counts(n_chunks);
+#pragma omp parallel for num_threads(threads) schedule(static)
+    for (ptrdiff_t c = 0; c < static_cast<ptrdiff_t>(n_chunks); c++)
+    {
+        counts[c].assign(n_buckets, 0);
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++)
+        {
+            counts[c][(key_of(i) >> shift) & (n_buckets - 1)]++;
+        }
+    }
+
+    std::vector<size_t> bucket_begin(n_buckets + 1, 0);
+    size_t position = 0;
+    for (size_t bucket = 0; bucket < n_buckets; bucket++)
+    {
+        bucket_begin[bucket] = position;
+        for (size_t c = 0; c < n_chunks; c++)
+        {
+            const size_t count = counts[c][bucket];
+            counts[c][bucket] = position;
+            position += count;
+        }
+    }
+    bucket_begin[n_buckets] = position;
+
+#pragma omp parallel for num_threads(threads) schedule(static)
+    for (ptrdiff_t c = 0; c < static_cast<ptrdiff_t>(n_chunks); c++)
+    {
+        std::vector<size_t> &cursor = counts[c];
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++)
+        {
+            Row row = row_of(i);
+            sorted[cursor[(static_cast<uint64_t>(std::get<0>(row)) >> shift) & (n_buckets - 1)]++] = row;
+        }
+    }
+
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 16)
+    for (ptrdiff_t bucket = 0; bucket < static_cast<ptrdiff_t>(n_buckets); bucket++)
+    {
+        std::sort(sorted.begin() + bucket_begin[bucket], sorted.begin() + bucket_begin[bucket + 1],
+                  [](const Row &a, const Row &b)
+                  { return std::get<0>(a) < std::get<0>(b); });
+    }
+    return sorted;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+// How weighted counters accumulate per-sample scores. A float Score keeps them as
+// they are; an unsigned integer Score stores round(score * 2^fraction_bits), so sums
+// are exact and the result does not depend on thread count, insertion order or how
+// partial counters were merged. Integer sums saturate at the largest Score.
+template <typename Score>
+class ScoreFormat
+{
+public:
+    static constexpr bool fixed_point = !std::is_floating_point<Score>::value;
+    static constexpr Score max_score = std::numeric_limits<Score>::max();
+
+    static int default_fraction_bits()
+    {
+        return fixed_point ? std::numeric_limits<Score>::digits / 2 : 0;
+    }
+
+    explicit ScoreFormat(int fraction_bits)
+        : fraction_bits(fraction_bits), unit(std::ldexp(1.0, fraction_bits)),
+          ceiling(std::nextafter(std::ldexp(1.0, std::numeric_limits<Score>::digits), 0.0))
+    {
+        if (!fixed_point && fraction_bits != 0)
+        {
+            throw std::invalid_argument("fraction_bits only applies to fixed-point scores.");
+        }
+        if (fixed_point && (fraction_bits < 1 || fraction_bits >= std::numeric_limits<Score>::digits))
+        {
+            throw std::invalid_argument("fraction_bits must be between 1 and " +
+                                        std::to_string(std::numeric_limits<Score>::digits - 1) + ".");
+        }
+    }
+
+    int bits() const
+    {
+        return fraction_bits;
+    }
+
+    // `score` must not be negative. Branch-free, so loops over it vectorise.
+    Score encode(double score) const
+    {
+        if (!fixed_point)
+        {
+            return static_cast<Score>(score);
+        }
+        return static_cast<Score>(std::min(score * unit + 0.5, ceiling));
+    }
+
+    Score add(Score a, Score b) const
+    {
+        if (!fixed_point)
+        {
+            return a + b;
+        }
+        return a > max_score - b ? max_score : a + b;
+    }
+
+    Score multiply(Score s, uint32_t factor) const
+    {
+        if (!fixed_point)
+        {
+            return s * factor;
+        }
+        return factor != 0 && s > max_score / factor ? max_score : s * factor;
+    }
+
+    // Integer part, as a count.
+    uint32_t truncate(Score s) const
+    {
+        if (!fixed_point)
+        {
+            return static_cast<uint32_t>(s);
+        }
+        return saturate(shift(s));
+    }
+
+    // Nearest integer, halves rounded up.
+    uint32_t round(Score s) const
+    {
+        if (!fixed_point)
+        {
+            return static_cast<uint32_t>(std::round(s));
+        }
+        return saturate(shift(add(s, half())));
+    }
+
+    // Nearest integer to s * factor, halves rounded up. Unlike multiply() followed by
+    // round(), the product is taken in 128 bits and neither step saturates.
+    uint64_t round_product(Score s, uint32_t factor) const
+    {
+        if (!fixed_point)
+        {
+            return static_cast<uint64_t>(std::min<double>(std::round(s * factor), 0x1p64 - 2048));
+        }
+        const unsigned __int128 product = static_cast<unsigned __int128>(s) * factor + half();
+        return static_cast<uint64_t>(std::min<unsigned __int128>(product >> fraction_bits, ~uint64_t(0)));
+    }
+
+    double decode(Score s) const
+    {
+        return static_cast<double>(s) / unit;
+    }
+
+    bool at_most_half(Score s) const
+    {
+        if (!fixed_point)
+        {
+            return s <= 0.5f;
+        }
+        return s <= half();
+    }
+
+    // at_most_half(s * factor), without saturating the product.
+    bool product_at_most_half(Score s, uint32_t factor) const
+    {
+        if (!fixed_point)
+        {
+            return s * factor <= 0.5f;
+        }
+        return static_cast<unsigned __int128>(s) * factor <= half();
+    }
+
+private:
+    int fraction_bits;
+    double unit;
+    // Largest double below 2^digits, which still converts to a Score.
+    double ceiling;
+
+    Score half() const
+    {
+        return static_cast<Score>(uint64_t(1) << (fraction_bits - 1));
+    }
+
+    Score shift(Score s) const
+    {
+        return static_cast<Score>(static_cast<uint64_t>(s) >> fraction_bits);
+    }
+
+    static uint32_t saturate(Score s)
+    {
+        return static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(s), std::numeric_limits<uint32_t>::max()));
+    }
+};
@@ -0,0 +1,757 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "zip_reader.hpp"
+
+// One sketch decoded from a sourmash signature file.
+struct DecodedSignature
+{
+    std::string source;
+    std::string name;
+    uint32_t ksize = 0;
+    uint64_t max_hash = 0;
+    uint64_t seed = 42;
+    std::string molecule;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> abundances;
+
+    // Same rule as sourmash's _get_scaled_for_max_hash.
+    uint64_t scale() const
+    {
+        if (max_hash == 0)
+        {
+            return 0;
+        }
+        return static_cast<uint64_t>(std::round(static_cast<double>(std::numeric_limits<uint64_t>::max()) / max_hash));
+    }
+
+    float mean_abundance() const
+    {
+        if (abundances.empty())
+        {
+            return 0.0f;
+        }
+        double total = 0;
+        for (uint32_t abundance : abundances)
+        {
+            total += abundance;
+        }
+        return static_cast<float>(total / abundances.size());
+    }
+};
+
+// Inverse of DecodedSignature::scale(), following sourmash's _get_max_hash_for_scaled.
+inline uint64_t max_hash_for_scale(uint64_t scale)
+{
+    if (scale <= 1)
+    {
+        return scale == 0 ? 0 : std::numeric_limits<uint64_t>::max();
+    }
+    return static_cast<uint64_t>(std::round(static_cast<double>(std::numeric_limits<uint64_t>::max()) / scale));
+}
+
+// Remembers the ksize/scale of the first signature a counter sees and rejects any
+// later signature that does not match it.
+struct SketchParams
+{
+    uint32_t ksize = 0;
+    uint64_t scale = 0;
+    bool seen = false;
+
+    void check(const DecodedSignature &sig)
+    {
+        if (!seen)
+        {
+            ksize = sig.ksize;
+            scale = sig.scale();
+            seen = true;
+        }
+        else if (sig.ksize != ksize || sig.scale() != scale)
+        {
+            throw std::invalid_argument("Signature '" + sig.source + "' has inconsistent scale or ksize.");
+        }
+    }
+
+    // Takes in the parameters seen by another counter being merged into this one.
+    void merge(const SketchParams &other)
+    {
+        if (!other.seen)
+        {
+            return;
+        }
+        if (!seen)
+        {
+            *this = other;
+        }
+        else if (other.ksize != ksize || other.scale != scale)
+        {
+            throw std::invalid_argument("Counters were filled from signatures of different scale or ksize.");
+        }
+    }
+};
+
+// Minimal JSON scanner specialised for sourmash signatures: it decodes the handful
+// of fields we count from and skips everything else without building a DOM.
+class SignatureJsonParser
+{
+public:
+    SignatureJsonParser(const char *data, size_t size, const std::string &source)
+        : p(data), end(data + size), source(source) {}
+
+    // Returns the sketch with the requested ksize (0 accepts any ksize, but then the
+    // file must hold a single sketch).
+    DecodedSignature parse(uint32_t ksize)
+    {
+        std::vector<DecodedSignature> sketches;
+        skip_ws();
+        if (peek() == '[')
+        {
+            ++p;
+            if (!consume(']'))
+            {
+                do
+                {
+                    parse_signature(ksize, sketches);
+                } while (consume(','));
+                expect(']');
+            }
+        }
+        else
+        {
+            parse_signature(ksize, sketches);
+        }
+
+        if (sketches.empty())
+        {
+            throw std::invalid_argument("Signature '" + source + "' has no sketch" +
+                                        (ksize ? " with ksize " + std::to_string(ksize) : std::string()) + ".");
+        }
+        if (sketches.size() > 1)
+        {
+            throw std::invalid_argument("Signature '" + source + "' holds several sketches; select one with a ksize.");
+        }
+        return std::move(sketches.front());
+    }
+
+private:
+    const char *p;
+    const char *end;
+    const std::string &source;
+
+    [[noreturn]] void fail(const char *what) const
+    {
+        throw std::invalid_argument("Malformed signature '" + source + "': " + what + ".");
+    }
+
+    void skip_ws()
+    {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+        {
+            ++p;
+        }
+    }
+
+    char peek()
+    {
+        skip_ws();
+        if (p == end)
+        {
+            fail("unexpected end of input");
+        }
+        return *p;
+    }
+
+    bool consume(char c)
+    {
+        if (peek() == c)
+        {
+            ++p;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c)
+    {
+        if (!consume(c))
+        {
+            fail("unexpected character");
+        }
+    }
+
+    std::string parse_string()
+    {
+        expect('"');
+        std::string out;
+        while (true)
+        {
+            if (p == end)
+            {
+                fail("unterminated string");
+            }
+            char c = *p++;
+            if (c == '"')
+            {
+                return out;
+            }
+            if (c != '\\')
+            {
+                out.push_back(c);
+                continue;
+            }
+            if (p == end)
+            {
+                fail("unterminated string");
+            }
+            c = *p++;
+            switch (c)
+            {
+            case 'b':
+                out.push_back('\b');
+                break;
+            case 'f':
+                out.push_back('\f');
+                break;
+            case 'n':
+                out.push_back('\n');
+                break;
+            case 'r':
+                out.push_back('\r');
+                break;
+            case 't':
+                out.push_back('\t');
+                break;
+            case 'u':
+                append_utf8(out, parse_hex4());
+                break;
+            default:
+                out.push_back(c);
+            }
+        }
+    }
+
+    uint32_t parse_hex4()
+    {
+        if (end - p < 4)
+        {
+            fail("truncated unicode escape");
+        }
+        uint32_t code = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            const char c = *p++;
+            code <<= 4;
+            if (c >= '0' && c <= '9')
+                code |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                code |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                code |= c - 'A' + 10;
+            else
+                fail("invalid unicode escape");
+        }
+        return code;
+    }
+
+    static void append_utf8(std::string &out, uint32_t code)
+    {
+        // Names are only used in messages, so unpaired surrogates are kept as-is.
+        if (code < 0x80)
+        {
+            out.push_back(static_cast<char>(code));
+        }
+        else if (code < 0x800)
+        {
+            out.push_back(static_cast<char>(0xC0 | (code >> 6)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        }
+        else
+        {
+            out.push_back(static_cast<char>(0xE0 | (code >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        }
+    }
+
+    uint64_t parse_uint64()
+    {
+        skip_ws();
+        if (p == end || *p < '0' || *p > '9')
+        {
+            fail("expected an unsigned integer");
+        }
+        uint64_t value = 0;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            const uint64_t digit = *p - '0';
+            if (value > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+            {
+                fail("integer out of range");
+            }
+            value = value * 10 + digit;
+            ++p;
+        }
+        return value;
+    }
+
+    void parse_uint64_array(std::vector<uint64_t> &out)
+    {
+        expect('[');
+        if (consume(']'))
+        {
+            return;
+        }
+        do
+        {
+            out.push_back(parse_uint64());
+        } while (consume(','));
+        expect(']');
+    }
+
+    void parse_uint32_array(std::vector<uint32_t> &out)
+    {
+        expect('[');
+        if (consume(']'))
+        {
+            return;
+        }
+        do
+        {
+            const uint64_t value = parse_uint64();
+            if (value > std::numeric_limits<uint32_t>::max())
+            {
+                fail("abundance out of range");
+            }
+            out.push_back(static_cast<uint32_t>(value));
+        } while (consume(','));
+        expect(']');
+    }
+
+    void skip_value()
+    {
+        const char c = peek();
+        if (c == '"')
+        {
+            ++p;
+            while (p < end && *p != '"')
+            {
+                p += (*p == '\\') ? 2 : 1;
+            }
+            if (p >= end)
+            {
+                fail("unterminated string");
+            }
+            ++p;
+        }
+        else if (c == '{' || c == '[')
+        {
+            const char close = (c == '{') ? '}' : ']';
+            ++p;
+            if (consume(close))
+            {
+                return;
+            }
+            do
+            {
+                if (close == '}')
+                {
+                    skip_value();
+                    expect(':');
+                }
+                skip_value();
+            } while (consume(','));
+            expect(close);
+        }
+        else
+        {
+            // Numbers and literals: run to the next delimiter.
+            while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+                   *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t')
+            {
+                ++p;
+            }
+        }
+    }
+
+    void parse_signature(uint32_t ksize, std::vector<DecodedSignature> &sketches)
+    {
+        std::string name;
+        const size_t first_sketch = sketches.size();
+
+        expect('{');
+        if (!consume('}'))
+        {
+            do
+            {
+                const std::string key = parse_string();
+                expect(':');
+                if (key == "name" && peek() == '"')
+                {
+                    name = parse_string();
+                }
+                else if (key == "signatures")
+                {
+                    expect('[');
+                    if (!consume(']'))
+                    {
+                        do
+                        {
+                            parse_sketch(ksize, sketches);
+                        } while (consume(','));
+                        expect(']');
+                    }
+                }
+                else
+                {
+                    skip_value();
+                }
+            } while (consume(','));
+            expect('}');
+        }
+
+        for (size_t i = first_sketch; i < sketches.size(); i++)
+        {
+            sketches[i].name = name;
+        }
+    }
+
+    void parse_sketch(uint32_t ksize, std::vector<DecodedSignature> &sketches)
+    {
+        DecodedSignature sketch;
+        sketch.source = source;
+        bool has_ksize = false;
+        bool wanted = true;
+
+        expect('{');
+        if (!consume('}'))
+        {
+            do
+            {
+                const std::string key = parse_string();
+                expect(':');
+                if (key == "ksize")
+                {
+                    sketch.ksize = static_cast<uint32_t>(parse_uint64());
+                    has_ksize = true;
+                    wanted = (ksize == 0 || sketch.ksize == ksize);
+                }
+                else if (key == "max_hash")
+                {
+                    sketch.max_hash = parse_uint64();
+                }
+                else if (key == "seed")
+                {
+                    sketch.seed = parse_uint64();
+                }
+                else if (key == "molecule" && peek() == '"')
+                {
+                    sketch.molecule = parse_string();
+                }
+                else if (key == "mins" && wanted)
+                {
+                    parse_uint64_array(sketch.hashes);
+                }
+                else if (key == "abundances" && wanted)
+                {
+                    parse_uint32_array(sketch.abundances);
+                }
+                else
+                {
+                    skip_value();
+                }
+            } while (consume(','));
+            expect('}');
+        }
+
+        if (!has_ksize)
+        {
+            fail("sketch without ksize");
+        }
+        if (!wanted)
+        {
+            return;
+        }
+        if (!sketch.abundances.empty() && sketch.abundances.size() != sketch.hashes.size())
+        {
+            fail("mins and abundances differ in length");
+        }
+        sketches.push_back(std::move(sketch));
+    }
+};
+
+// Reads a whole file, transparently decompressing it when it is gzipped.
+inline std::string read_signature_bytes(const std::string &path)
+{
+    gzFile file = gzopen(path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        throw std::runtime_error("Cannot open signature '" + path + "': " + std::strerror(errno));
+    }
+    gzbuffer(file, 1 << 20);
+
+    std::string bytes;
+    const size_t chunk = size_t(1) << 24;
+    while (true)
+    {
+        const size_t old_size = bytes.size();
+        bytes.resize(old_size + chunk);
+        const int n = gzread(file, &bytes[old_size], static_cast<unsigned>(chunk));
+        if (n < 0)
+        {
+            int error_code = 0;
+            const std::string message = gzerror(file, &error_code);
+            gzclose(file);
+            throw std::runtime_error("Cannot read signature '" + path + "': " + message);
+        }
+        bytes.resize(old_size + n);
+        if (n == 0)
+        {
+            break;
+        }
+    }
+    gzclose(file);
+    return bytes;
+}
+
+inline DecodedSignature parse_signature_bytes(const std::string &bytes, const std::string &source, uint32_t ksize)
+{
+    if (bytes.size() >= 2 && static_cast<unsigned char>(bytes[0]) == 0x1f && static_cast<unsigned char>(bytes[1]) == 0x8b)
+    {
+        const std::string json = inflate_bytes(bytes.data(), bytes.size(), 16 + MAX_WBITS, 0, source);
+        return SignatureJsonParser(json.data(), json.size(), source).parse(ksize);
+    }
+    return SignatureJsonParser(bytes.data(), bytes.size(), source).parse(ksize);
+}
+
+inline DecodedSignature read_signature_file(const std::string &path, uint32_t ksize)
+{
+    const std::string bytes = read_signature_bytes(path);
+    return SignatureJsonParser(bytes.data(), bytes.size(), path).parse(ksize);
+}
+
+// Splits one CSV record starting at `pos`, honouring quoted fields, and moves `pos`
+// past it.
+inline std::vector<std::string> next_csv_record(const std::string &text, size_t &pos)
+{
+    std::vector<std::string> fields(1);
+    bool quoted = false;
+    while (pos < text.size())
+    {
+        const char c = text[pos++];
+        if (quoted)
+        {
+            if (c == '"' && pos < text.size() && text[pos] == '"')
+            {
+                fields.back().push_back('"');
+                ++pos;
+            }
+            else if (c == '"')
+            {
+                quoted = false;
+            }
+            else
+            {
+                fields.back().push_back(c);
+            }
+        }
+        else if (c == '"')
+        {
+            quoted = true;
+        }
+        else if (c == ',')
+        {
+            fields.emplace_back();
+        }
+        else if (c == '\n')
+        {
+            break;
+        }
+        else if (c != '\r')
+        {
+            fields.back().push_back(c);
+        }
+    }
+    return fields;
+}
+
+// A zip member holding a signature, with its hash count when the manifest gives it.
+struct ZipSignature
+{
+    const ZipMember *member;
+    uint64_t n_hashes;
+};
+
+// Lists the members of a sourmash zip collection that hold signatures. When the
+// collection carries a SOURMASH-MANIFEST.csv it is used to pick the members (and to
+// skip sketches of another ksize without decompressing them); otherwise every
+// .sig/.sig.gz/.json member is taken and their sizes are unknown (0).
+inline std::vector<ZipSignature> signature_members(const ZipArchive &archive, uint32_t ksize)
+{
+    std::vector<ZipSignature> selected;
+    std::unordered_set<const ZipMember *> seen;
+
+    const ZipMember *manifest = archive.find("SOURMASH-MANIFEST.csv");
+    if (manifest != nullptr)
+    {
+        const std::string text = archive.read(*manifest);
+        size_t pos = 0;
+        std::vector<std::string> header;
+        while (pos < text.size() && header.empty())
+        {
+            std::vector<std::string> record = next_csv_record(text, pos);
+            if (!record.front().empty() && record.front()[0] != '#')
+            {
+                header = std::move(record);
+            }
+        }
+
+        const auto column = [&](const char *name)
+        {
+            for (size_t i = 0; i < header.size(); i++)
+            {
+                if (header[i] == name)
+                {
+                    return static_cast<ptrdiff_t>(i);
+                }
+            }
+            return ptrdiff_t(-1);
+        };
+        const ptrdiff_t location_column = column("internal_location");
+        const ptrdiff_t ksize_column = column("ksize");
+        const ptrdiff_t n_hashes_column = column("n_hashes");
+        if (location_column < 0)
+        {
+            throw std::invalid_argument("Manifest of '" + archive.get_path() + "' has no internal_location column.");
+        }
+
+        while (pos < text.size())
+        {
+            const std::vector<std::string> record = next_csv_record(text, pos);
+            if (record.size() <= static_cast<size_t>(location_column) || record[location_column].empty())
+            {
+                continue;
+            }
+            if (ksize != 0 && ksize_column >= 0 && static_cast<size_t>(ksize_column) < record.size() &&
+                record[ksize_column] != std::to_string(ksize))
+            {
+                continue;
+            }
+            const ZipMember *member = archive.find(record[location_column]);
+            if (member == nullptr)
+            {
+                throw std::invalid_argument("Manifest of '" + archive.get_path() + "' lists missing member '" +
+                                            record[location_column] + "'.");
+            }
+            // A member holding several sketches has one manifest row per sketch.
+            if (seen.insert(member).second)
+            {
+                uint64_t n_hashes = 0;
+                if (n_hashes_column >= 0 && static_cast<size_t>(n_hashes_column) < record.size())
+                {
+                    n_hashes = std::strtoull(record[n_hashes_column].c_str(), nullptr, 10);
+                }
+                selected.push_back({member, n_hashes});
+            }
+        }
+        return selected;
+    }
+
+    const auto ends_with = [](const std::string &name, const char *suffix)
+    {
+        const size_t n = std::strlen(suffix);
+        return name.size() >= n && name.compare(name.size() - n, n, suffix) == 0;
+    };
+    for (const ZipMember &member : archive.get_members())
+    {
+        if (ends_with(member.name, ".sig") || ends_with(member.name, ".sig.gz") ||
+            ends_with(member.name, ".json") || ends_with(member.name, ".json.gz"))
+        {
+            selected.push_back({&member, 0});
+        }
+    }
+    return selected;
+}
+
+// A signature to decode: either a standalone file or one member of a zip collection.
+struct SignatureSource
+{
+    std::string path;
+    const ZipArchive *archive = nullptr;
+    const ZipMember *member = nullptr;
+
+    // Number of hashes as listed in the zip manifest; 0 when unknown.
+    uint64_t n_hashes = 0;
+
+    DecodedSignature read(uint32_t ksize) const
+    {
+        if (archive == nullptr)
+        {
+            return read_signature_file(path, ksize);
+        }
+        return parse_signature_bytes(archive->read(*member), path + ":" + member->name, ksize);
+    }
+};
+
+inline bool is_zip_path(const std::string &path)
+{
+    return path.size() >= 4 && (path.compare(path.size() - 4, 4, ".zip") == 0 ||
+                                 path.compare(path.size() - 4, 4, ".ZIP") == 0);
+}
+
+// Expands `paths` into individual signatures, opening zip collections into
+// `archives` (which must outlive the returned sources).
+inline std::vector<SignatureSource> expand_signature_paths(const std::vector<std::string> &paths, uint32_t ksize,
+                                                           std::vector<std::unique_ptr<ZipArchive>> &archives)
+{
+    std::vector<SignatureSource> sources;
+    sources.reserve(paths.size());
+    for (const std::string &path : paths)
+    {
+        if (!is_zip_path(path))
+        {
+            sources.push_back({path, nullptr, nullptr, 0});
+            continue;
+        }
+        archives.push_back(std::make_unique<ZipArchive>(path));
+        for (const ZipSignature &entry : signature_members(*archives.back(), ksize))
+        {
+            sources.push_back({path, archives.back().get(), entry.member, entry.n_hashes});
+        }
+    }
+    return sources;
+}
+
+// Sketch parameters of the first signature in `path` (a signature file or a zip
+// collection), for counters that must be configured before ingest starts.
+struct SignatureInfo
+{
+    uint32_t ksize;
+    uint64_t scale;
+    uint64_t n_hashes;
+    std::string name;
+};
+
+inline SignatureInfo signature_info(const std::string &path, uint32_t ksize)
+{
+    std::vector<std::unique_ptr<ZipArchive>> archives;
+    const std::vector<SignatureSource> sources = expand_signature_paths({path}, ksize, archives);
+    if (sources.empty())
+    {
+        throw std::invalid_argument("'" + path + "' holds no signatures.");
+    }
+    const DecodedSignature sig = sources.front().read(ksize);
+    return {sig.ksize, sig.scale(), sig.hashes.size(), sig.name};
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "md5.hpp"
+#include "sig_reader.hpp"
+
+// Sketch parameters and labels written with a signature.
+struct SignatureHeader
+{
+    std::string name;
+    std::string filename;
+    uint32_t ksize = 0;
+    uint64_t scale = 0;
+    uint64_t seed = 42;
+    std::string molecule = "DNA";
+};
+
+// Writes `value` in decimal ending at `end` and returns where the digits start. Two
+// digits per step from a lookup table, as the output is mostly 19-digit hashes.
+inline char *format_decimal(uint64_t value, char *end)
+{
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char *p = end;
+    while (value >= 100)
+    {
+        const unsigned pair = static_cast<unsigned>(value % 100) * 2;
+        value /= 100;
+        *--p = pairs[pair + 1];
+        *--p = pairs[pair];
+    }
+    if (value >= 10)
+    {
+        const unsigned pair = static_cast<unsigned>(value) * 2;
+        *--p = pairs[pair + 1];
+        *--p = pairs[pair];
+    }
+    else
+    {
+        *--p = static_cast<char>('0' + value);
+    }
+    return p;
+}
+
+// Buffered output to a signature file, gzip-compressed when the path ends in ".gz".
+// Memory is one buffer whatever the number of hashes written.
+class SignatureOutput
+{
+public:
+    static constexpr size_t buffer_bytes = size_t(1) << 20;
+
+    SignatureOutput(const std::string &path, int compression)
+        : path(path), buffer(new char[buffer_bytes]), end(buffer.get() + buffer_bytes), pos(buffer.get())
+    {
+        if (compression < 0 || compression > 9)
+        {
+            throw std::invalid_argument("compression must be between 0 and 9.");
+        }
+        const bool gzip = path.size() >= 3 && path.compare(path.size() - 3, 3, ".gz") == 0;
+        // "T" has zlib write the bytes as they are, so both cases share one code path.
+        const std::string mode = gzip ? "wb" + std::to_string(compression) : "wbT";
+        file = gzopen(path.c_str(), mode.c_str());
+        if (file == nullptr)
+        {
+            throw std::runtime_error("Cannot create signature '" + path + "': " + std::strerror(errno));
+        }
+        gzbuffer(file, 1 << 20);
+    }
+
+    ~SignatureOutput()
+    {
+        if (file != nullptr)
+        {
+            gzclose(file);
+        }
+    }
+
+    SignatureOutput(const SignatureOutput &) = delete;
+    SignatureOutput &operator=(const SignatureOutput &) = delete;
+
+    void write(const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            if (pos == end)
+            {
+                flush();
+            }
+            const size_t take = std::min(size, static_cast<size_t>(end - pos));
+            std::memcpy(pos, data, take);
+            pos += take;
+            data += take;
+            size -= take;
+        }
+    }
+
+    void write(const std::string &text)
+    {
+        write(text.data(), text.size());
+    }
+
+    // Writes `value` in decimal, after a comma unless it is `first` in its list, and
+    // returns the digits, valid until the next write.
+    std::pair<const char *, size_t> write_number(uint64_t value, bool first = true)
+    {
+        if (end - pos < 21)
+        {
+            flush();
+        }
+        if (!first)
+        {
+            *pos++ = ',';
+        }
+        char digits[20];
+        const char *begin = format_decimal(value, digits + sizeof(digits));
+        const size_t size = digits + sizeof(digits) - begin;
+        std::memcpy(pos, begin, size);
+        pos += size;
+        return {pos - size, size};
+    }
+
+    // JSON string literal, with quotes, backslashes and control characters escaped.
+    void write_string(const std::string &text)
+    {
+        static const char hex[] = "0123456789abcdef";
+        write("\"", 1);
+        for (const char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                const char escaped[2] = {'\\', c};
+                write(escaped, 2);
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                const char escaped[6] = {'\\', 'u', '0', '0', hex[(c >> 4) & 15], hex[c & 15]};
+                write(escaped, 6);
+            }
+            else
+            {
+                write(&c, 1);
+            }
+        }
+        write("\"", 1);
+    }
+
+    void close()
+    {
+        flush();
+        const int status = gzclose(file);
+        file = nullptr;
+        if (status != Z_OK)
+        {
+            throw std::runtime_error("Cannot write signature '" + path + "': " + zError(status));
+        }
+    }
+
+private:
+    std::string path;
+    gzFile file = nullptr;
+    std::unique_ptr<char[]> buffer;
+    char *end;
+    char *pos;
+
+    void flush()
+    {
+        const size_t size = pos - buffer.get();
+        if (size > 0 && gzwrite(file, buffer.get(), static_cast<unsigned>(size)) != static_cast<int>(size))
+        {
+            int error_code = 0;
+            throw std::runtime_error("Cannot write signature '" + path + "': " + gzerror(file, &error_code));
+        }
+        pos = buffer.get();
+    }
+};
+
+// Writes one sketch as a sourmash JSON signature (a one-element list, in the field
+// order sourmash writes), streaming `hashes` and `abundances` (null for a sketch
+// without abundances) to `path`; ".gz" paths are gzip-compressed at `compression`.
+// Level 1 is the usual choice: on hash digits it comes within a few percent of level
+// 6 in size at several times the speed. `hashes` must be sorted, as sourmash stores
+// them. The md5sum field follows the mins in that order, so it is hashed from the
+// digits as they are written; without `md5sum` the field is left out and readers
+// compute it when they need it.
+inline void write_signature(const std::string &path, const SignatureHeader &header, const uint64_t *hashes,
+                            const uint32_t *abundances, size_t n, bool md5sum, int compression)
+{
+    SignatureOutput out(path, compression);
+    out.write("[{\"class\":\"sourmash_signature\",\"email\":\"\",\"hash_function\":\"0.murmur64\",\"filename\":");
+    out.write_string(header.filename);
+    out.write(",\"name\":");
+    out.write_string(header.name);
+    out.write(",\"license\":\"CC0\",\"signatures\":[{\"num\":0,\"ksize\":");
+    out.write(std::to_string(header.ksize));
+    out.write(",\"seed\":");
+    out.write(std::to_string(header.seed));
+    out.write(",\"max_hash\":");
+    out.write(std::to_string(max_hash_for_scale(header.scale)));
+
+    Md5 md5;
+    md5.update(std::to_string(header.ksize));
+    out.write(",\"mins\":[");
+    for (size_t i = 0; i < n; i++)
+    {
+        const auto digits = out.write_number(hashes[i], i == 0);
+        if (md5sum)
+        {
+            md5.update(digits.first, digits.second);
+        }
+    }
+    out.write("]");
+    if (md5sum)
+    {
+        out.write(",\"md5sum\":\"" + md5.hex_digest() + "\"");
+    }
+    if (abundances != nullptr)
+    {
+        out.write(",\"abundances\":[");
+        for (size_t i = 0; i < n; i++)
+        {
+            out.write_number(abundances[i], i == 0);
+        }
+        out.write("]");
+    }
+    out.write(",\"molecule\":");
+    out.write_string(header.molecule);
+    out.write("}],\"version\":0.4}]\n");
+    out.close();
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <parallel_hashmap/phmap.h>
+
+#include "hashers.hpp"
+
+// Linear-probing hash table with narrow counts, stored as separate key and count
+// arrays so a slot costs 8 + sizeof(Count) bytes (phmap pads a uint64_t/uint8_t pair
+// to 16 bytes plus a control byte). A zero count marks an empty slot.
+//
+// Counts that reach the largest Count value are promoted: the slot keeps that value
+// as a marker and the exact count moves to a small side map, so the occasional
+// very abundant hash costs a map entry while every other one stays narrow.
+//
+// `slot_hash` passed to add() must be the same function of the key that the owner
+// gives as `rehash_slot` when the table grows.
+template <typename Count>
+class SmallCountTable
+{
+public:
+    static constexpr Count saturated = std::numeric_limits<Count>::max();
+
+    template <typename SlotOf>
+    void add(uint64_t key, size_t slot_hash, SlotOf &&rehash_slot)
+    {
+        if ((used + 1) * 5 > counts.size() * 4)
+        {
+            rehash(std::max<size_t>(16, counts.size() * 2), rehash_slot);
+        }
+        const size_t mask = counts.size() - 1;
+        for (size_t i = slot_hash & mask;; i = (i + 1) & mask)
+        {
+            if (counts[i] == 0)
+            {
+                keys[i] = key;
+                counts[i] = 1;
+                used++;
+                return;
+            }
+            if (keys[i] == key)
+            {
+                if (counts[i] < saturated - 1)
+                {
+                    counts[i]++;
+                }
+                else if (counts[i] == saturated - 1)
+                {
+                    counts[i] = saturated;
+                    overflow[key] = saturated;
+                }
+                else
+                {
+                    uint32_t &count = overflow[key];
+                    count += count < std::numeric_limits<uint32_t>::max();
+                }
+                return;
+            }
+        }
+    }
+
+    void prefetch(size_t slot_hash) const
+    {
+        if (!counts.empty())
+        {
+            const size_t i = slot_hash & (counts.size() - 1);
+            __builtin_prefetch(&counts[i]);
+            __builtin_prefetch(&keys[i]);
+        }
+    }
+
+    template <typename SlotOf>
+    void reserve(size_t n, SlotOf &&rehash_slot)
+    {
+        size_t capacity = 16;
+        while (n * 5 > capacity * 4)
+        {
+            capacity *= 2;
+        }
+        if (capacity > counts.size())
+        {
+            rehash(capacity, rehash_slot);
+        }
+    }
+
+    size_t size() const
+    {
+        return used;
+    }
+
+    size_t overflow_size() const
+    {
+        return overflow.size();
+    }
+
+    size_t bytes() const
+    {
+        return keys.size() * sizeof(uint64_t) + counts.size() * sizeof(Count) +
+               overflow.capacity() * (sizeof(std::pair<uint64_t, uint32_t>) + 1);
+    }
+
+    // Calls f(key, exact_count) for every entry.
+    template <typename F>
+    void for_each(F &&f) const
+    {
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            if (counts[i] != 0)
+            {
+                f(keys[i], exact_count(i));
+            }
+        }
+    }
+
+    // Drops the entries whose exact count fails `keep` and returns how many were
+    // dropped. Linear probing cannot leave holes behind, so survivors are reinserted.
+    template <typename Keep, typename SlotOf>
+    size_t filter(Keep &&keep, SlotOf &&rehash_slot)
+    {
+        std::vector<uint64_t> old_keys;
+        std::vector<Count> old_counts;
+        old_keys.swap(keys);
+        old_counts.swap(counts);
+        const size_t before = used;
+
+        size_t kept = 0;
+        for (size_t i = 0; i < old_counts.size(); i++)
+        {
+            if (old_counts[i] != 0)
+            {
+                const uint32_t count = old_counts[i] == saturated ? overflow.at(old_keys[i]) : old_counts[i];
+                if (keep(count))
+                {
+                    kept++;
+                }
+                else
+                {
+                    old_counts[i] = 0;
+                    if (count >= saturated)
+                    {
+                        overflow.erase(old_keys[i]);
+                    }
+                }
+            }
+        }
+
+        used = 0;
+        if (kept > 0)
+        {
+            reserve(kept, rehash_slot);
+        }
+        for (size_t i = 0; i < old_counts.size(); i++)
+        {
+            if (old_counts[i] != 0)
+            {
+                place(old_keys[i], old_counts[i], rehash_slot(old_keys[i]));
+            }
+        }
+        return before - kept;
+    }
+
+private:
+    std::vector<uint64_t> keys;
+    std::vector<Count> counts;
+    size_t used = 0;
+    // Keys of one owner partition share their low bits, so they need mixing.
+    phmap::flat_hash_map<uint64_t, uint32_t, MixedHash> overflow;
+
+    uint32_t exact_count(size_t i) const
+    {
+        return counts[i] == saturated ? overflow.at(keys[i]) : counts[i];
+    }
+
+    // Stores a key known to be absent with its raw slot count.
+    void place(uint64_t key, Count count, size_t slot_hash)
+    {
+        const size_t mask = counts.size() - 1;
+        size_t i = slot_hash & mask;
+        while (counts[i] != 0)
+        {
+            i = (i + 1) & mask;
+        }
+        keys[i] = key;
+        counts[i] = count;
+        used++;
+    }
+
+    template <typename SlotOf>
+    void rehash(size_t capacity, SlotOf &&rehash_slot)
+    {
+        std::vector<uint64_t> old_keys(capacity);
+        std::vector<Count> old_counts(capacity, 0);
+        old_keys.swap(keys);
+        old_counts.swap(counts);
+        used = 0;
+        for (size_t i = 0; i < old_counts.size(); i++)
+        {
+            if (old_counts[i] != 0)
+            {
+                place(old_keys[i], old_counts[i], rehash_slot(old_keys[i]));
+            }
+        }
+    }
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "radix_sort.hpp"
+
+// Distinct hashes in increasing order with their occurrence counts.
+struct CountRun
+{
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> counts;
+
+    size_t size() const
+    {
+        return hashes.size();
+    }
+};
+
+// Collapses a sorted sequence of hashes into a run of distinct hashes and counts.
+inline CountRun run_length_encode(const std::vector<uint64_t> &sorted)
+{
+    CountRun run;
+    for (size_t i = 0; i < sorted.size();)
+    {
+        size_t j = i + 1;
+        while (j < sorted.size() && sorted[j] == sorted[i])
+        {
+            j++;
+        }
+        run.hashes.push_back(sorted[i]);
+        run.counts.push_back(static_cast<uint32_t>(std::min<size_t>(j - i, std::numeric_limits<uint32_t>::max())));
+        i = j;
+    }
+    return run;
+}
+
+// Merges runs into one, summing (saturating) the counts of hashes present in
+// several of them.
+//
+// The key space is cut at quantiles of the largest run into ranges that are merged
+// independently by the workers, each with a k-way merge over its slice of every
+// input run. The ranges come out in key order, so they are simply concatenated.
+inline CountRun merge_runs(const std::vector<const CountRun *> &runs, int threads)
+{
+    size_t total = 0;
+    const CountRun *largest = nullptr;
+    for (const CountRun *run : runs)
+    {
+        total += run->size();
+        if (!largest || run->size() > largest->size())
+        {
+            largest = run;
+        }
+    }
+    if (total == 0)
+    {
+        return CountRun();
+    }
+
+    const size_t min_range = size_t(1) << 16;
+    const size_t n_ranges = std::max<size_t>(1, std::min<size_t>(static_cast<size_t>(std::max(threads, 1)) * 4, total / min_range));
+
+    // bounds[p * runs.size() + r] is where range p starts in run r.
+    std::vector<size_t> bounds((n_ranges + 1) * runs.size());
+    for (size_t r = 0; r < runs.size(); r++)
+    {
+        bounds[r] = 0;
+        bounds[n_ranges * runs.size() + r] = runs[r]->size();
+    }
+    for (size_t p = 1; p < n_ranges; p++)
+    {
+        const uint64_t splitter = largest->hashes[p * largest->size() / n_ranges];
+        for (size_t r = 0; r < runs.size(); r++)
+        {
+            const std::vector<uint64_t> &hashes = runs[r]->hashes;
+            bounds[p * runs.size() + r] = std::lower_bound(hashes.begin(), hashes.end(), splitter) - hashes.begin();
+        }
+    }
+
+    std::vector<CountRun> merged(n_ranges);
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (ptrdiff_t p = 0; p < static_cast<ptrdiff_t>(n_ranges); p++)
+    {
+        std::vector<size_t> cursor(bounds.begin() + p * runs.size(), bounds.begin() + (p + 1) * runs.size());
+        const size_t *end = &bounds[(p + 1) * runs.size()];
+        CountRun &out = merged[p];
+        size_t expected = 0;
+        for (size_t r = 0; r < runs.size(); r++)
+        {
+            expected = std::max(expected, end[r] - cursor[r]);
+        }
+        out.hashes.reserve(expected);
+        out.counts.reserve(expected);
+
+        while (true)
+        {
+            // Run counts stay small (a merge fan-in), so a linear scan beats a heap.
+            uint64_t smallest = std::numeric_limits<uint64_t>::max();
+            bool any = false;
+            for (size_t r = 0; r < runs.size(); r++)
+            {
+                if (cursor[r] < end[r] && (!any || runs[r]->hashes[cursor[r]] < smallest))
+                {
+                    smallest = runs[r]->hashes[cursor[r]];
+                    any = true;
+                }
+            }
+            if (!any)
+            {
+                break;
+            }
+
+            uint64_t count = 0;
+            for (size_t r = 0; r < runs.size(); r++)
+            {
+                if (cursor[r] < end[r] && runs[r]->hashes[cursor[r]] == smallest)
+                {
+                    count += runs[r]->counts[cursor[r]++];
+                }
+            }
+            out.hashes.push_back(smallest);
+            out.counts.push_back(static_cast<uint32_t>(std::min<uint64_t>(count, std::numeric_limits<uint32_t>::max())));
+        }
+    }
+
+    std::vector<size_t> offsets(n_ranges + 1, 0);
+    for (size_t p = 0; p < n_ranges; p++)
+    {
+        offsets[p + 1] = offsets[p] + merged[p].size();
+    }
+
+    CountRun result;
+    result.hashes.resize(offsets[n_ranges]);
+    result.counts.resize(offsets[n_ranges]);
+#pragma omp parallel for num_threads(threads) schedule(static)
+    for (ptrdiff_t p = 0; p < static_cast<ptrdiff_t>(n_ranges); p++)
+    {
+        std::copy(merged[p].hashes.begin(), merged[p].hashes.end(), result.hashes.begin() + offsets[p]);
+        std::copy(merged[p].counts.begin(), merged[p].counts.end(), result.counts.begin() + offsets[p]);
+        std::vector<uint64_t>().swap(merged[p].hashes);
+        std::vector<uint32_t>().swap(merged[p].counts);
+    }
+    return result;
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// (hash, count) pair as stored in a spill file: 12 bytes, host byte order.
+struct SpillRecord
+{
+    uint64_t key;
+    uint32_t count;
+};
+
+// One temporary file per partition, in a private directory created under
+// `parent_dir` (TMPDIR or /tmp when empty) and removed with everything in it on
+// destruction. Records are buffered per partition, so appends to different
+// partitions may run concurrently; a single partition must not be used from two
+// threads at once. A file is only open while it is being written or read, so the
+// partition count is not limited by RLIMIT_NOFILE; that costs one open() per
+// 64 KiB flushed.
+class SpillFiles
+{
+public:
+    static constexpr size_t record_bytes = sizeof(uint64_t) + sizeof(uint32_t);
+    static constexpr size_t buffer_bytes = size_t(1) << 16;
+
+    SpillFiles(size_t n_parts, const std::string &parent_dir) : parts(n_parts)
+    {
+        std::string parent = parent_dir;
+        if (parent.empty())
+        {
+            const char *tmp = std::getenv("TMPDIR");
+            parent = tmp && *tmp ? tmp : "/tmp";
+        }
+        std::string pattern = parent + "/hashes-counter-XXXXXX";
+        if (!::mkdtemp(&pattern[0]))
+        {
+            throw std::runtime_error("Cannot create a spill directory in '" + parent + "': " + std::strerror(errno));
+        }
+        dir = pattern;
+    }
+
+    ~SpillFiles()
+    {
+        remove_all();
+    }
+
+    SpillFiles(const SpillFiles &) = delete;
+    SpillFiles &operator=(const SpillFiles &) = delete;
+
+    size_t size() const
+    {
+        return parts.size();
+    }
+
+    const std::string &directory() const
+    {
+        return dir;
+    }
+
+    void append(size_t part, uint64_t key, uint32_t count)
+    {
+        Part &p = parts[part];
+        if (p.buffer.size() + record_bytes > buffer_bytes)
+        {
+            flush(part);
+        }
+        const size_t at = p.buffer.size();
+        p.buffer.resize(at + record_bytes);
+        std::memcpy(&p.buffer[at], &key, sizeof(key));
+        std::memcpy(&p.buffer[at + sizeof(key)], &count, sizeof(count));
+    }
+
+    void flush(size_t part)
+    {
+        Part &p = parts[part];
+        if (p.buffer.empty())
+        {
+            return;
+        }
+        const PartFile file(*this, part, O_WRONLY | O_CREAT);
+        p.created = true;
+        write_at(part, file.fd, p.end, p.buffer.data(), p.buffer.size());
+        p.end += p.buffer.size();
+        p.buffer.clear();
+    }
+
+    // Every record of a partition, pending appends included.
+    std::vector<SpillRecord> read(size_t part)
+    {
+        flush(part);
+        const Part &p = parts[part];
+        std::vector<unsigned char> bytes(p.end);
+        if (p.end > 0)
+        {
+            const PartFile file(*this, part, O_RDONLY);
+            read_at(part, file.fd, 0, bytes.data(), bytes.size());
+        }
+        std::vector<SpillRecord> records(p.end / record_bytes);
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            std::memcpy(&records[i].key, &bytes[i * record_bytes], sizeof(uint64_t));
+            std::memcpy(&records[i].count, &bytes[i * record_bytes + sizeof(uint64_t)], sizeof(uint32_t));
+        }
+        return records;
+    }
+
+    // Replaces the contents of a partition.
+    void rewrite(size_t part, const std::vector<SpillRecord> &records)
+    {
+        Part &p = parts[part];
+        p.buffer.clear();
+        p.end = 0;
+        if (p.created)
+        {
+            // Opening with O_TRUNC empties the file.
+            const PartFile file(*this, part, O_WRONLY | O_TRUNC);
+        }
+        for (const SpillRecord &record : records)
+        {
+            append(part, record.key, record.count);
+        }
+        flush(part);
+    }
+
+    uint64_t records(size_t part) const
+    {
+        return (parts[part].end + parts[part].buffer.size()) / record_bytes;
+    }
+
+    uint64_t bytes_on_disk() const
+    {
+        uint64_t total = 0;
+        for (const Part &p : parts)
+        {
+            total += p.end;
+        }
+        return total;
+    }
+
+private:
+    struct Part
+    {
+        bool created = false;
+        uint64_t end = 0;
+        std::vector<unsigned char> buffer;
+    };
+
+    // A partition's file, open for the lifetime of the object.
+    struct PartFile
+    {
+        int fd;
+
+        PartFile(const SpillFiles &files, size_t part, int flags)
+        {
+            fd = ::open(files.file_path(part).c_str(), flags, 0600);
+            if (fd < 0)
+            {
+                files.fail(part, (flags & O_CREAT) ? "create" : "open");
+            }
+        }
+
+        ~PartFile()
+        {
+            ::close(fd);
+        }
+
+        PartFile(const PartFile &) = delete;
+        PartFile &operator=(const PartFile &) = delete;
+    };
+
+    std::string dir;
+    std::vector<Part> parts;
+
+    std::string file_path(size_t part) const
+    {
+        return dir + "/part-" + std::to_string(part);
+    }
+
+    [[noreturn]] void fail(size_t part, const std::string &what) const
+    {
+        throw std::runtime_error("Cannot " + what + " spill file '" + file_path(part) + "': " + std::strerror(errno));
+    }
+
+    void write_at(size_t part, int fd, uint64_t offset, const unsigned char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t n = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                fail(part, "write");
+            }
+            data += n;
+            offset += n;
+            size -= n;
+        }
+    }
+
+    void read_at(size_t part, int fd, uint64_t offset, unsigned char *out, size_t size) const
+    {
+        while (size > 0)
+        {
+            const ssize_t n = ::pread(fd, out, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                fail(part, "read");
+            }
+            out += n;
+            offset += n;
+            size -= n;
+        }
+    }
+
+    void remove_all()
+    {
+        for (size_t p = 0; p < parts.size(); p++)
+        {
+            if (parts[p].created)
+            {
+                ::unlink(file_path(p).c_str());
+                parts[p].created = false;
+            }
+        }
+        ::rmdir(dir.c_str());
+    }
+};
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Inflates a whole zlib stream. `window_bits` selects the framing: -MAX_WBITS for
+// raw deflate (zip members) or 16 + MAX_WBITS for gzip.
+inline std::string inflate_bytes(const char *data, size_t size, int window_bits, size_t size_hint,
+                                 const std::string &source)
+{
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, window_bits) != Z_OK)
+    {
+        throw std::runtime_error("Cannot initialise zlib for '" + source + "'.");
+    }
+
+    std::string out;
+    out.resize(size_hint ? size_hint : size * 4 + 1024);
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    size_t consumed = 0;
+    size_t produced = 0;
+    int status = Z_OK;
+    while (status != Z_STREAM_END)
+    {
+        if (produced == out.size())
+        {
+            out.resize(out.size() * 2);
+        }
+        // zlib counts in uInt, so very large buffers are fed in slices.
+        const size_t in_chunk = std::min<size_t>(size - consumed, 1u << 30);
+        const size_t out_chunk = std::min<size_t>(out.size() - produced, 1u << 30);
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data + consumed));
+        stream.avail_in = static_cast<uInt>(in_chunk);
+        stream.next_out = reinterpret_cast<Bytef *>(&out[produced]);
+        stream.avail_out = static_cast<uInt>(out_chunk);
+
+        status = inflate(&stream, Z_NO_FLUSH);
+        consumed += in_chunk - stream.avail_in;
+        produced += out_chunk - stream.avail_out;
+
+        if (status == Z_STREAM_END && window_bits > MAX_WBITS && consumed < size)
+        {
+            // Concatenated gzip members are legal; keep going with the next one.
+            inflateReset(&stream);
+            status = Z_OK;
+        }
+        else if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+        {
+            inflateEnd(&stream);
+            throw std::runtime_error("Corrupt compressed data in '" + source + "'.");
+        }
+        else if (status == Z_BUF_ERROR && consumed == size && produced < out.size())
+        {
+            inflateEnd(&stream);
+            throw std::runtime_error("Truncated compressed data in '" + source + "'.");
+        }
+    }
+    inflateEnd(&stream);
+    out.resize(produced);
+    return out;
+}
+
+// An entry of a zip file's central directory.
+struct ZipMember
+{
+    std::string name;
+    uint16_t method;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint64_t local_header_offset;
+};
+
+// Read-only zip archive (including zip64) backed by a file descriptor. Members are
+// read with pread, so one archive can be shared by any number of reader threads.
+class ZipArchive
+{
+public:
+    explicit ZipArchive(const std::string &path) : path(path)
+    {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Cannot open zip '" + path + "': " + std::strerror(errno));
+        }
+        try
+        {
+            read_central_directory();
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+    }
+
+    ~ZipArchive()
+    {
+        ::close(fd);
+    }
+
+    ZipArchive(const ZipArchive &) = delete;
+    ZipArchive &operator=(const ZipArchive &) = delete;
+
+    const std::string &get_path() const
+    {
+        return path;
+    }
+
+    const std::vector<ZipMember> &get_members() const
+    {
+        return members;
+    }
+
+    const ZipMember *find(const std::string &name) const
+    {
+        const auto it = index.find(name);
+        return it == index.end() ? nullptr : &members[it->second];
+    }
+
+    // Returns the decompressed contents of `member`.
+    std::string read(const ZipMember &member) const
+    {
+        unsigned char header[30];
+        read_at(member.local_header_offset, header, sizeof(header));
+        if (le32(header) != 0x04034b50)
+        {
+            fail("bad local header for '" + member.name + "'");
+        }
+        const uint64_t data_offset = member.local_header_offset + 30 + le16(header + 26) + le16(header + 28);
+
+        std::string compressed(member.compressed_size, '\0');
+        read_at(data_offset, &compressed[0], compressed.size());
+
+        if (member.method == 0)
+        {
+            return compressed;
+        }
+        if (member.method == 8)
+        {
+            return inflate_bytes(compressed.data(), compressed.size(), -MAX_WBITS, member.uncompressed_size,
+                                 path + ":" + member.name);
+        }
+        fail("unsupported compression method for '" + member.name + "'");
+    }
+
+private:
+    std::string path;
+    int fd = -1;
+    std::vector<ZipMember> members;
+    std::unordered_map<std::string, size_t> index;
+
+    static uint16_t le16(const unsigned char *p)
+    {
+        return static_cast<uint16_t>(p[0] | (p[1] << 8));
+    }
+
+    static uint32_t le32(const unsigned char *p)
+    {
+        return static_cast<uint32_t>(le16(p)) | (static_cast<uint32_t>(le16(p + 2)) << 16);
+    }
+
+    static uint64_t le64(const unsigned char *p)
+    {
+        return static_cast<uint64_t>(le32(p)) | (static_cast<uint64_t>(le32(p + 4)) << 32);
+    }
+
+    [[noreturn]] void fail(const std::string &what) const
+    {
+        throw std::runtime_error("Malformed zip '" + path + "': " + what + ".");
+    }
+
+    void read_at(uint64_t offset, void *out, size_t size) const
+    {
+        char *dst = static_cast<char *>(out);
+        while (size > 0)
+        {
+            const ssize_t n = ::pread(fd, dst, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                fail("unexpected end of file");
+            }
+            dst += n;
+            offset += n;
+            size -= n;
+        }
+    }
+
+    void read_central_directory()
+    {
+        const off_t file_size = ::lseek(fd, 0, SEEK_END);
+        if (file_size < 22)
+        {
+            fail("file too small");
+        }
+
+        // The end-of-central-directory record sits within the last 64 KiB + 22 bytes.
+        const uint64_t tail_size = std::min<uint64_t>(file_size, 65535 + 22);
+        std::vector<unsigned char> tail(tail_size);
+        read_at(file_size - tail_size, tail.data(), tail_size);
+
+        ptrdiff_t eocd = -1;
+        for (ptrdiff_t i = static_cast<ptrdiff_t>(tail_size) - 22; i >= 0; i--)
+        {
+            if (le32(&tail[i]) == 0x06054b50)
+            {
+                eocd = i;
+                break;
+            }
+        }
+        if (eocd < 0)
+        {
+            fail("no end of central directory record");
+        }
+
+        uint64_t entries = le16(&tail[eocd + 10]);
+        uint64_t directory_size = le32(&tail[eocd + 12]);
+        uint64_t directory_offset = le32(&tail[eocd + 16]);
+
+        // Zip64: the locator sits right before the classic record.
+        const uint64_t eocd_offset = file_size - tail_size + eocd;
+        if (eocd_offset >= 20)
+        {
+            unsigned char locator[20];
+            read_at(eocd_offset - 20, locator, sizeof(locator));
+            if (le32(locator) == 0x07064b50)
+            {
+                unsigned char record[56];
+                read_at(le64(locator + 8), record, sizeof(record));
+                if (le32(record) != 0x06064b50)
+                {
+                    fail("bad zip64 end of central directory record");
+                }
+                entries = le64(record + 32);
+                directory_size = le64(record + 40);
+                directory_offset = le64(record + 48);
+            }
+        }
+
+        std::vector<unsigned char> directory(directory_size);
+        read_at(directory_offset, directory.data(), directory_size);
+
+        members.reserve(entries);
+        size_t pos = 0;
+        for (uint64_t e = 0; e < entries; e++)
+        {
+            if (pos + 46 > directory.size() || le32(&directory[pos]) != 0x02014b50)
+            {
+                fail("bad central directory entry");
+            }
+            const unsigned char *entry = &directory[pos];
+            const uint16_t name_length = le16(entry + 28);
+            const uint16_t extra_length = le16(entry + 30);
+            const uint16_t comment_length = le16(entry + 32);
+            if (pos + 46 + name_length + extra_length + comment_length > directory.size())
+            {
+                fail("truncated central directory");
+            }
+
+            ZipMember member;
+            member.name.assign(reinterpret_cast<const char *>(entry + 46), name_length);
+            member.method = le16(entry + 10);
+            member.compressed_size = le32(entry + 20);
+            member.uncompressed_size = le32(entry + 24);
+            member.local_header_offset = le32(entry + 42);
+
+            // Sizes and offsets saturated at 0xFFFFFFFF live in the zip64 extra field,
+            // in this fixed order.
+            const unsigned char *extra = entry + 46 + name_length;
+            for (size_t x = 0; x + 4 <= extra_length;)
+            {
+                const uint16_t id = le16(extra + x);
+                const uint16_t length = le16(extra + x + 2);
+                if (id == 0x0001)
+                {
+                    const unsigned char *field = extra + x + 4;
+                    const unsigned char *field_end = field + length;
+                    if (member.uncompressed_size == 0xFFFFFFFF && field + 8 <= field_end)
+                    {
+                        member.uncompressed_size = le64(field);
+                        field += 8;
+                    }
+                    if (member.compressed_size == 0xFFFFFFFF && field + 8 <= field_end)
+                    {
+                        member.compressed_size = le64(field);
+                        field += 8;
+                    }
+                    if (member.local_header_offset == 0xFFFFFFFF && field + 8 <= field_end)
+                    {
+                        member.local_header_offset = le64(field);
+                    }
+                }
+                x += 4 + length;
+            }
+
+            if (member.name.empty() || member.name.back() != '/')
+            {
+                index.emplace(member.name, members.size());
+                members.push_back(std::move(member));
+            }
+            pos += 46 + name_length + extra_length + comment_length;
+        }
+    }
+};